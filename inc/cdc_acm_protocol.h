@@ -37,12 +37,13 @@
 #define CMD_GET_PARAMS      5
 /* CMD_MOTOR, length=4, drive#, on/off. Turn on/off a drive motor. */
 #define CMD_MOTOR           6
-/* CMD_READ_FLUX, length=8-12. Argument is gw_read_flux; optional fields
+/* CMD_READ_FLUX, length=8-17. Argument is gw_read_flux; optional fields
  * may be omitted. Returns flux readings terminating with EOStream (NUL). */
 #define CMD_READ_FLUX       7
-/* CMD_WRITE_FLUX, length=4-8. Argument is gw_write_flux.
+/* CMD_WRITE_FLUX, length=4-15. Argument is gw_write_flux.
  * Host follows the ACK with flux values terminating with EOStream (NUL).
- * Device finally returns a status byte, 0 on success.
+ * Device finally returns a status byte, 0 on success. If _GW_WF_verify is
+ * set, the status byte is followed by a gw_verify record.
  * No further commands should be issued until the status byte is received. */
 #define CMD_WRITE_FLUX      8
 /* CMD_GET_FLUX_STATUS, length=2. Last read/write status returned in ACK. */
@@ -79,7 +80,49 @@
  * but will reset the Disk Change signal if a disk has been inserted. 
  * On successful return the drive is always at cylinder 0. */
 #define CMD_NOCLICK_STEP   22
-#define CMD_MAX            22
+/* CMD_READ_SECTORS, length=6-7. Argument is gw_read_sectors.
+ * Decodes IBM-format sectors from the current track. Returns a stream of
+ * gw_sector records, each followed by 128<<n bytes of sector data if
+ * _GW_SF_data is set, and terminated by EOStream (NUL).
+ * Final status is retrieved by CMD_GET_FLUX_STATUS, as for CMD_READ_FLUX. */
+#define CMD_READ_SECTORS   23
+/* CMD_READ_HISTOGRAM, length=5. Argument is gw_read_histogram.
+ * Bins flux intervals on the device, for @revs full revolutions. Returns,
+ * for each revolution, a uint32_t index-to-index period in ticks followed by
+ * @nr_bins uint32_t bin counts. The stream terminates with EOStream (NUL).
+ * Final status is retrieved by CMD_GET_FLUX_STATUS, as for CMD_READ_FLUX. */
+#define CMD_READ_HISTOGRAM 24
+/* CMD_READ_TRACKS, length=10. Argument is gw_read_tracks.
+ * Seeks, selects head and reads flux for each track in turn, cylinder-major.
+ * Returns, for each track, a gw_track header, a flux stream as for
+ * CMD_READ_FLUX terminated by EOStream (NUL), and an ACK_* status byte.
+ * The command stops after the last track or the first non-ACK_OKAY status,
+ * and the stream is then terminated by a further EOStream (NUL). A failed
+ * track's flux stream holds whatever was read before the failure.
+ * On ACK_FLUX_OVERFLOW the stream is truncated at an arbitrary point and
+ * must be discarded in its entirety.
+ * Final status is retrieved by CMD_GET_FLUX_STATUS, as for CMD_READ_FLUX. */
+#define CMD_READ_TRACKS    25
+/* CMD_DETECT_FORMAT, length=6. Argument is gw_detect_format.
+ * Samples flux on the current track and classifies its encoding and cell
+ * period. Returns a gw_format record terminated by EOStream (NUL).
+ * Final status is retrieved by CMD_GET_FLUX_STATUS, as for CMD_READ_FLUX. */
+#define CMD_DETECT_FORMAT  26
+/* CMD_WRITE_BITCELLS, length=12-16. Argument is gw_write_bitcells.
+ * Host follows the ACK with exactly (nr_cells+7)/8 bytes of packed bitcells,
+ * eight cells per byte, MSB first. A 1 cell ends with a flux transition.
+ * Device finally returns a status byte, 0 on success, as for CMD_WRITE_FLUX.
+ * No further commands should be issued until the status byte is received. */
+#define CMD_WRITE_BITCELLS 27
+/* CMD_FORMAT_TRACK, length=13. Argument is gw_format_track.
+ * Host follows the ACK with, for each sector, its 4-byte ID field (c,h,r,n)
+ * and then, if _GW_FT_data is set, 128<<size_code bytes of sector data.
+ * Device writes an IBM-format track from index to index, generating all
+ * gaps, sync marks and CRCs. Device finally returns a status byte, 0 on
+ * success, or ACK_FLUX_OVERFLOW if the sectors did not fit on the track.
+ * No further commands should be issued until the status byte is received. */
+#define CMD_FORMAT_TRACK   28
+#define CMD_MAX            28
 
 
 /*
@@ -145,6 +188,37 @@
  *  Generate regular flux transitions at specified astable period. 
  *  Duration is specified by immediately preceding FLUXOP_SPACE opcode(s). */
 #define FLUXOP_ASTABLE    3
+/* FLUXOP_SECTOR [CMD_READ_FLUX]
+ *  Args:
+ *   +4 [N28]: ticks to sector hole, relative to sample cursor.
+ *  Signals a sector hole in the read stream of hard-sectored media (see
+ *  gw_read_flux.hard_sector_ticks). The extra index hole is signalled by
+ *  FLUXOP_INDEX as usual. Sample cursor is unaffected. */
+#define FLUXOP_SECTOR     4
+
+
+/*
+ * Nibble flux stream encoding. Selected per command by _GW_RF_nibble_enc
+ * (CMD_READ_FLUX) or _GW_WF_nibble_enc (CMD_WRITE_FLUX).
+ * 
+ * Most flux intervals are sent as a 4-bit interval class C (1-14), denoting
+ * an interval of C*quantum ticks. Stream bytes are interpreted as follows:
+ *  0x00:      EOStream
+ *  0xFF:      Flux opcode, exactly as in the standard stream
+ *  0xF0-0xFE: Low nibble is an interval class (or 0 for none). This is then
+ *             followed by one interval in standard stream encoding.
+ *  Others:    Low nibble is an interval class (1-14). High nibble is a
+ *             second interval class (1-14), or 0 for none.
+ * When reading, an interval is classed only if it is within tolerance of
+ * C*quantum, allowing for the error already accumulated by earlier classed
+ * intervals. The host's sample cursor is therefore never more than
+ * tolerance ticks from the true sample cursor. Other intervals are sent
+ * exactly, and do not disturb the accumulated error.
+ */
+struct packed gw_nibble_enc {
+    uint16_t quantum;   /* ticks per interval class */
+    uint16_t tolerance; /* [CMD_READ_FLUX] max ticks error per interval */
+};
 
 
 /*
@@ -177,6 +251,24 @@ struct packed gw_bw_stats {
     } min_bw, max_bw;
 };
 
+/* CMD_GET_INFO, index 2 */
+#define GETINFO_FLUX_STATS 2
+struct packed gw_flux_stats {
+    struct packed gw_flux_op_stats {
+        /* Peak bytes buffered in the USB ring. */
+        uint32_t u_buf_peak;
+        /* Minimum bytes to spare before overflow (read) or underflow
+         * (write). ~0 if not yet measured. */
+        uint32_t min_slack;
+        /* USB packets sent (read) or received (write). */
+        uint32_t usb_packets;
+        /* Peak samples buffered in the flux DMA ring. */
+        uint16_t dma_peak;
+        /* Longest main-loop iteration, in microseconds (saturates). */
+        uint16_t max_loop_us;
+    } last, all; /* last flux operation; all since power on */
+};
+
 #define GETINFO_CURRENT_DRIVE 7
 #define GETINFO_DRIVE(unit)   (8+(unit))
 struct packed gw_drive_info {
@@ -197,6 +289,104 @@ struct packed gw_read_flux {
     /** OPTIONAL FIELDS: **/
     /* Linger time, in ticks, to continue reading after @max_index pulses. */
     uint32_t max_index_linger; /* default: 500 microseconds */
+    /* Read options (_GW_RF_* flags). */
+#define _GW_RF_sram_capture 0 /* Capture entire read to SRAM, then send it.
+                               * Fails with ACK_OUT_OF_SRAM if too large. */
+#define _GW_RF_nibble_enc   1 /* Nibble-encoded flux stream */
+#define _GW_RF_irq_encode   2 /* Process flux in DMA IRQ, not just main loop */
+#define _GW_RF_index_cued   3 /* Stream starts at first index pulse, with
+                               * FLUXOP_INDEX at zero ticks. On STM32F1 the
+                               * index pulse starts the sample counter.
+                               * Elsewhere, and with hard_sector_ticks, the
+                               * stream is aligned to the index timestamp. */
+/*#define _GW_RF_cache      4*/ /* reserved: formerly a track cache */
+#define _GW_RF_wide_enc     5 /* Wide flux encoding, for high sample clocks.
+                               * 1-199: One byte, N.
+                               * 200-14224: Two bytes, 200+(N-200)/255 and
+                               * 1+(N-200)%255.
+                               * Longer: FLUXOP_SPACE(N-199) and then 199. */
+    uint8_t flags; /* default: 0 */
+    /* Nibble stream parameters. Mandatory if _GW_RF_nibble_enc is set. */
+    struct gw_nibble_enc nibble;
+    /* Hard sector time, in ticks. If non-zero, every sector hole is reported
+     * by FLUXOP_SECTOR and only the extra index hole by FLUXOP_INDEX. */
+    uint32_t hard_sector_ticks; /* default: 0 (disabled) */
+    /* Window within each revolution, in ticks from index. Flux outside the
+     * window is discarded: its time is folded into the next interval sent,
+     * or into a FLUXOP_SPACE. Index pulses are reported regardless. Nothing
+     * is sent before the first index pulse. */
+    uint32_t window_start; /* default: 0 */
+    uint32_t window_end;   /* default: 0 (no window) */
+};
+
+/* CMD_READ_SECTORS */
+struct packed gw_read_sectors {
+#define SECENC_IBM_FM  0
+#define SECENC_IBM_MFM 1
+    uint8_t encoding;
+    /* Index pulses to read for. Sectors are reported once only. */
+    uint8_t revs;
+    /* Nominal bitcell period (clock or data), in ticks. */
+    uint16_t cell_ticks;
+    /** OPTIONAL FIELDS: **/
+    /* Read options (_GW_RS_* flags). */
+#define _GW_RS_until_good 0 /* Stop early once a full revolution finds no new
+                             * sector and every sector has good data. If
+                             * @revs runs out first, the unresolved sectors
+                             * (if any) are followed by a _GW_SF_flux record.
+                             * This includes a track with no sectors. */
+    uint8_t flags; /* default: 0 */
+};
+struct packed gw_sector {
+#define _GW_SF_valid    0 /* Clear only in EOStream (a single NUL byte) */
+#define _GW_SF_data     1 /* Good data follows (CRC ok) */
+#define _GW_SF_deleted  2 /* Data is marked deleted */
+#define _GW_SF_bad_data 3 /* Data found, but never with good CRC */
+#define _GW_SF_flux     4 /* Final record (no ID): One revolution of flux
+                           * follows, as for CMD_READ_FLUX with
+                           * _GW_RF_index_cued. */
+    uint8_t flags;
+    uint8_t c, h, r, n; /* ID field (CRC ok) */
+};
+
+/* CMD_READ_TRACKS */
+struct packed gw_read_tracks {
+    /* Inclusive cylinder and head ranges. */
+    int16_t cyl_first, cyl_last;
+    uint8_t head_first, head_last;
+    /* Index pulses to read for, on each track. */
+    uint16_t revs;
+};
+struct packed gw_track {
+    int16_t cyl;
+    uint8_t head;
+};
+
+/* CMD_DETECT_FORMAT */
+struct packed gw_detect_format {
+    /* Ticks to sample for. */
+    uint32_t ticks;
+};
+struct packed gw_format {
+#define FMTENC_unknown 0
+#define FMTENC_FM      1 /* flux intervals of 1-2 cells */
+#define FMTENC_MFM     2 /* flux intervals of 2-4 cells */
+#define FMTENC_GCR     3 /* flux intervals of 1-3 cells */
+    uint8_t encoding;
+    /* Percentage of flux intervals within 1/4 cell of the expected set. */
+    uint8_t confidence;
+    /* Cell period (clock or data, for FM and MFM), in ticks. */
+    uint32_t cell_ticks;
+};
+
+/* CMD_READ_HISTOGRAM */
+struct packed gw_read_histogram {
+    /* Full revolutions (index to index) to report. */
+    uint8_t revs;
+    /* Number of bins (1-64). The final bin counts all longer intervals. */
+    uint8_t nr_bins;
+    /* Bin width is (1<<shift) ticks. */
+    uint8_t shift;
 };
 
 /* CMD_WRITE_FLUX */
@@ -209,6 +399,72 @@ struct packed gw_write_flux {
     /* Hard sector time, in ticks. Used to find first sector and to trigger
      * cue_at_index and terminate_at_index, if they are enabled. */
     uint32_t hard_sector_ticks; /* default: 0 (disabled) */
+    /* Write options (_GW_WF_* flags). */
+#define _GW_WF_nibble_enc 0 /* Nibble-encoded flux stream */
+#define _GW_WF_verify     1 /* Re-read the track and compare with the flux
+                             * written. Requires cue_at_index. With
+                             * terminate_at_index, the re-read starts at the
+                             * index pulse which ends the write. */
+#define _GW_WF_preload    2 /* Receive the whole stream before writing.
+                             * Fails with ACK_OUT_OF_SRAM, before anything
+                             * is written, if it does not fit. */
+    uint8_t flags; /* default: 0 */
+    /* Nibble stream parameters. Mandatory if _GW_WF_nibble_enc is set. */
+    struct gw_nibble_enc nibble;
+    /* Verify tolerance, in ticks. Applies to each of the first few intervals
+     * (used to locate the written flux) and to the end time of each block of
+     * intervals, which is also allowed 1/256 of the block length after
+     * correcting for measured drive speed. Each block must also hold exactly
+     * the written number of intervals. */
+    uint16_t verify_tolerance; /* default: 0 (300 nanoseconds) */
+};
+struct packed gw_verify {
+    /* Written flux is compared in blocks of @block_len intervals, counted
+     * from the first written flux transition. With terminate_at_index, the
+     * blocks within 2ms of the index pulse are passed over while the write
+     * turns around. A partial final block before the index pulse spans the
+     * write splice, and is not compared. */
+    uint32_t block_len;
+    uint32_t nr_blocks; /* blocks compared */
+    uint32_t nr_mismatch; /* blocks outside tolerance */
+    /* Interval offsets of the first and last mismatched blocks, or ~0 if
+     * there are none. If the written flux cannot be located, every block
+     * is mismatched. */
+    uint32_t first_mismatch, last_mismatch;
+};
+
+/* CMD_WRITE_BITCELLS */
+struct packed gw_write_bitcells {
+    /* Bitcell period, in ticks. */
+    uint32_t cell_ticks;
+    /* Number of bitcells in the stream which follows. */
+    uint32_t nr_cells;
+    /* As for gw_write_flux. */
+    uint8_t cue_at_index;
+    uint8_t terminate_at_index;
+    /** OPTIONAL FIELDS: **/
+    uint32_t hard_sector_ticks; /* default: 0 (disabled) */
+};
+
+/* CMD_FORMAT_TRACK */
+struct packed gw_format_track {
+    /* SECENC_IBM_FM or SECENC_IBM_MFM. */
+    uint8_t encoding;
+    /* Number of sectors, in the order they are sent and written. */
+    uint8_t nr_sectors;
+    /* Bitcell period (clock or data), in ticks, as for gw_read_sectors. */
+    uint16_t cell_ticks;
+    /* Sector data is 128<<size_code bytes (size_code <= 6). */
+    uint8_t size_code;
+    /* Gap lengths, in bytes. If @gap4a is zero, the index address mark and
+     * its preceding gap are omitted. The track is filled to the index pulse
+     * after the last sector. */
+    uint8_t gap4a, gap1, gap2, gap3;
+    /* Sector data fill byte, if _GW_FT_data is clear. */
+    uint8_t fill;
+    /* Format options (_GW_FT_* flags). */
+#define _GW_FT_data 0 /* Host sends sector data after each ID field */
+    uint8_t flags;
 };
 
 /* CMD_ERASE_FLUX */
@@ -235,6 +491,38 @@ struct packed gw_delay {
     uint16_t index_mask;   /* (usec) post-trigger index mask */
 };
 
+/* CMD_{GET,SET}_PARAMS, index 1 */
+#define PARAMS_SAMPLE 1
+struct packed gw_sample {
+    /* Flux sample clock (Hz), also reported by gw_info.sample_freq.
+     * Default is 72MHz. Must be a whole number of MHz that divides the
+     * system clock, and at least 12MHz. Lower clocks (eg. 36MHz, 24MHz)
+     * shrink the flux stream for DD media. Only STM32F7 supports clocks
+     * above 72MHz (eg. 108MHz, 216MHz). Other values are rejected with
+     * ACK_BAD_COMMAND. */
+    uint32_t sample_freq;
+};
+
+/* CMD_{GET,SET}_PARAMS, index 2 */
+#define PARAMS_PRECOMP 2
+struct packed gw_precomp {
+    /* Write precompensation. Intervals shorter than @short_ns are short,
+     * and those from @short_ns up to twice that are long. A flux transition
+     * between a short and a long interval is moved by the shift for the
+     * current cylinder, into the short interval. */
+    uint16_t short_ns;
+    /* The shift for a cylinder is that of the last range before the first
+     * range whose @cyl exceeds the cylinder; or none, if there is no such
+     * range. Ranges are in ascending @cyl order; unused ranges have @cyl =
+     * 0xffff. Default: All ranges unused (no precompensation). Parameters
+     * are rejected with ACK_BAD_COMMAND if the ranges are out of order, or
+     * if a used range's shift is not less than @short_ns/2. */
+    struct packed {
+        uint16_t cyl;
+        uint16_t shift_ns;
+    } range[4];
+};
+
 /* CMD_SWITCH_FW_MODE */
 #define FW_MODE_BOOTLOADER 0
 #define FW_MODE_NORMAL     1
@@ -35,6 +35,7 @@
 #include "timer.h"
 #include "usb.h"
 #include "cdc_acm_protocol.h"
+#include "flux_stream.h"
 
 /*
  * Local variables:
@@ -0,0 +1,155 @@
+/*
+ * flux_stream.h
+ *
+ * Encoding and decoding of flux intervals in the read/write flux stream,
+ * in standard and nibble encodings.
+ * Self-contained apart from cdc_acm_protocol.h, so that it can also be
+ * built on the host (see tests/).
+ *
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+/* Interval encoding, given the first two-byte lead (250 standard, or 200
+ * with _GW_RF_wide_enc). For lead 250 the ranges are shown in brackets:
+ *  1 to lead-1 [1-249]: One byte, N.
+ *  lead to lead+255*(255-lead)-1 [250-1524]: Two bytes, lead+(N-lead)/255
+ *   and 1+(N-lead)%255.
+ *  Longer [1525-]: Seven bytes, FLUXOP_SPACE(N-(lead-1)) and then lead-1. */
+#define FLUX_MAX_ENC 7
+
+/* N28 argument of a flux stream opcode. */
+static always_inline uint8_t *flux_encode_n28(uint8_t *q, uint32_t x)
+{
+    *q++ = 1 | (x <<  1);
+    *q++ = 1 | (x >>  6);
+    *q++ = 1 | (x >> 13);
+    *q++ = 1 | (x >> 20);
+    return q;
+}
+
+static always_inline uint32_t flux_decode_n28(const uint8_t *p)
+{
+    uint32_t x;
+    x  = (p[0]       ) >>  1;
+    x |= (p[1] & 0xfe) <<  6;
+    x |= (p[2] & 0xfe) << 13;
+    x |= (p[3] & 0xfe) << 20;
+    return x;
+}
+
+/* Encode a non-zero interval at @q. Returns the end of the encoding. */
+static always_inline uint8_t *flux_encode(uint8_t *q, uint32_t ticks,
+                                          unsigned int lead)
+{
+    unsigned int high;
+
+    if (ticks < lead) {
+        *q++ = ticks;
+        return q;
+    }
+
+    high = (ticks-lead) / 255;
+    if (high < (255-lead)) {
+        *q++ = lead + high;
+        *q++ = 1 + ((ticks-lead) % 255);
+        return q;
+    }
+
+    *q++ = 0xff;
+    *q++ = FLUXOP_SPACE;
+    q = flux_encode_n28(q, ticks - (lead-1));
+    *q++ = lead-1;
+    return q;
+}
+
+/* Two-byte interval: @b0 is in the range [lead,254]. */
+static always_inline uint32_t flux_decode2(uint8_t b0, uint8_t b1,
+                                           unsigned int lead)
+{
+    return lead + (b0 - lead) * 255 + b1 - 1;
+}
+
+/* Nibble stream encoding (see cdc_acm_protocol.h): Encoder state. */
+struct nibble_enc {
+    uint32_t quantum; /* 0 -> standard stream encoding */
+    uint32_t tolerance;
+    int32_t error; /* true sample cursor minus host's sample cursor */
+    uint8_t pending; /* interval class awaiting a partner (or 0) */
+};
+
+/* Longest nibble encoding of one interval: An escape byte, followed by the
+ * interval in standard encoding. */
+#define NIBBLE_MAX_ENC (1 + FLUX_MAX_ENC)
+
+/* Emit any interval class still awaiting a partner. This must precede a
+ * flux opcode or EOStream. Returns the end of the encoding. */
+static always_inline uint8_t *nibble_flush(struct nibble_enc *ne, uint8_t *q)
+{
+    if (ne->pending) {
+        *q++ = ne->pending;
+        ne->pending = 0;
+    }
+    return q;
+}
+
+/* Encode a non-zero interval at @q. An interval which cannot be classed
+ * within tolerance is escaped, and sent exactly in standard encoding with
+ * the given @lead. Returns the end of the encoding. */
+static always_inline uint8_t *nibble_encode(struct nibble_enc *ne,
+                                            uint8_t *q, uint32_t ticks,
+                                            unsigned int lead)
+{
+    uint32_t quantum = ne->quantum, class;
+    int32_t target, error;
+
+    /* Find the nearest interval class, accounting for the error we have
+     * already accumulated in the host's sample cursor. */
+    target = ticks + ne->error;
+    class = (target + quantum/2) / quantum;
+    error = target - class * quantum;
+
+    if (((class - 1) >= 14)
+        || ((error < 0 ? -error : error) > ne->tolerance)) {
+        /* Escape: Send the exact interval. */
+        *q++ = 0xf0 | ne->pending;
+        ne->pending = 0;
+        return flux_encode(q, ticks, lead);
+    }
+
+    ne->error = error;
+    if (ne->pending) {
+        *q++ = ne->pending | (class << 4);
+        ne->pending = 0;
+    } else {
+        ne->pending = class;
+    }
+    return q;
+}
+
+/* Decode nibble stream byte @b, other than EOStream (0x00) or a flux
+ * opcode (0xff). Returns the first interval class (0 for none), and sets
+ * @next to the second (0 for none) or to 15 if an interval in standard
+ * encoding follows. Returns -1 if @b is invalid. */
+static always_inline int nibble_decode(uint8_t b, unsigned int *next)
+{
+    unsigned int lo = b & 15, hi = b >> 4;
+
+    if ((lo == 15) || ((lo == 0) && (hi != 15)))
+        return -1;
+
+    *next = hi;
+    return lo;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -85,6 +85,8 @@ struct exception_frame {
 /* Cortex initialisation */
 void cortex_init(void);
 
+#define DCACHE_LINE 32
+
 #if defined(CORTEX_M7)
 
 /* Cache operations */
@@ -92,6 +94,10 @@ void icache_invalidate_all(void);
 void icache_enable(void);
 void dcache_invalidate_all(void);
 void dcache_clear_and_invalidate_all(void);
+/* Maintenance by address, for buffers shared with bus masters (DMA). Lines
+ * only partially covered by [@p,@p+@len) are affected in their entirety. */
+void dcache_invalidate_range(const void *p, uint32_t len);
+void dcache_clear_range(const void *p, uint32_t len);
 void dcache_enable(void);
 void dcache_disable(void);
 
@@ -102,6 +108,8 @@ void dcache_disable(void);
 #define icache_enable() ((void)0)
 #define dcache_invalidate_all() ((void)0)
 #define dcache_clear_and_invalidate_all() ((void)0)
+#define dcache_invalidate_range(p, len) ((void)0)
+#define dcache_clear_range(p, len) ((void)0)
 #define dcache_enable() ((void)0)
 #define dcache_disable() ((void)0)
 
@@ -0,0 +1,59 @@
+/*
+ * sec_decode.h
+ *
+ * State of the IBM FM/MFM sector decoder (src/sec_decode.c). Self-contained,
+ * so that the decoder can also be built on the host (see tests/).
+ *
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+#define MAX_SECTORS 64
+
+struct secdec {
+    uint8_t encoding;
+    /* PLL state. Periods are in ticks << 8. */
+    int32_t ticks, clock, clock_centre;
+    /* Raw bitcell shift register. */
+    uint32_t sr;
+    enum {
+        SD_search, /* searching for a sync mark */
+        SD_mark,   /* MFM: awaiting address mark after sync */
+        SD_id,     /* reading ID field */
+        SD_data    /* reading data field */
+    } state;
+    /* Byte assembly. */
+    unsigned int bitcnt, bytecnt;
+    uint8_t byte;
+    uint16_t crc;
+    /* Most recent good ID field, and bitcells remaining before it is too
+     * far behind us to be associated with a data field. */
+    uint8_t id[4];
+    struct sector *sec;
+    unsigned int id_ttl;
+    /* Data field being read into u_buf[], after space for its header. */
+    uint32_t data_prod, data_len;
+    bool_t deleted;
+    /* Read until good: Stop early once done, else follow up with raw flux
+     * (including when no sector is found at all). */
+    bool_t until_good, done;
+    unsigned int nr_sectors_at_index;
+    /* Sectors seen so far on this track. */
+    unsigned int nr_sectors;
+    struct sector {
+        uint8_t id[4];
+        enum { SEC_id, SEC_bad_data, SEC_good } state;
+    } sectors[MAX_SECTORS];
+};
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
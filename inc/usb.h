@@ -44,6 +44,16 @@ bool_t ep_tx_ready(uint8_t ep);
  * REQUIRES: ep_tx_ready(@ep) == TRUE */
 void usb_write(uint8_t ep, const void *buf, uint32_t len);
 
+/* Largest IN transfer accepted by usb_write_xfer(). A multiple of the bulk
+ * MPS; equal to it if multi-packet transfers are not supported. */
+uint32_t usb_max_xfer(void);
+
+/* Queue an IN transfer of one or more packets. Unlike usb_write(), the 
+ * payload may be sent directly from @buf, which must not be modified until
+ * ep_tx_ready(@ep). @buf must be 32-bit aligned.
+ * REQUIRES: ep_tx_ready(@ep) == TRUE && @len <= usb_max_xfer() */
+void usb_write_xfer(uint8_t ep, const void *buf, uint32_t len);
+
 /* Is the USB enumerated at High Speed? */
 bool_t usb_is_highspeed(void);
 
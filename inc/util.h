@@ -133,6 +133,7 @@ void EXC_unused(void);
 /* IRQ priorities, 0 (highest) to 15 (lowest). */
 #define RESET_IRQ_PRI         0
 #define INDEX_IRQ_PRI         2
+#define FLUX_IRQ_PRI          3
 #define TIMER_IRQ_PRI         4
 #define USB_IRQ_PRI           6
 
@@ -174,6 +174,27 @@ void dcache_clear_and_invalidate_all(void)
     _dcache_op_all(&cache->dccisw);
 }
 
+static void _dcache_op_range(
+    volatile uint32_t *opreg, const void *p, uint32_t len)
+{
+    uint32_t a = (uint32_t)p & ~(DCACHE_LINE-1), e = (uint32_t)p + len;
+
+    cpu_sync();
+    for (; a < e; a += DCACHE_LINE)
+        *opreg = a;
+    cpu_sync();
+}
+
+void dcache_invalidate_range(const void *p, uint32_t len)
+{
+    _dcache_op_range(&cache->dcimvac, p, len);
+}
+
+void dcache_clear_range(const void *p, uint32_t len)
+{
+    _dcache_op_range(&cache->dccmvac, p, len);
+}
+
 void dcache_enable(void)
 {
     dcache_invalidate_all();
@@ -18,11 +18,15 @@
 #define configure_pin(pin, type) \
     gpio_configure_pin(gpio_##pin, pin_##pin, type)
 
-#define SAMPLE_MHZ 72
-#define TIM_PSC (SYSCLK_MHZ / SAMPLE_MHZ)
-#define sample_ns(x) (((x) * SAMPLE_MHZ) / 1000)
-#define sample_us(x) ((x) * SAMPLE_MHZ)
-#define time_from_samples(x) udiv64((uint64_t)(x) * TIME_MHZ, SAMPLE_MHZ)
+/* Flux sample clock (PARAMS_SAMPLE). Validated by sample_mhz_ok(). */
+#define DEFAULT_SAMPLE_MHZ 72
+#define MIN_SAMPLE_MHZ 12 /* ~83ns: still fine enough for DD media */
+static unsigned int sample_mhz = DEFAULT_SAMPLE_MHZ;
+#define TIM_PSC (SYSCLK_MHZ / sample_mhz)
+#define sample_ns(x) (((x) * sample_mhz) / 1000)
+#define sample_us(x) ((x) * sample_mhz)
+#define time_from_samples(x) udiv64((uint64_t)(x) * TIME_MHZ, sample_mhz)
+#define samples_from_time(x) udiv64((uint64_t)(x) * sample_mhz, TIME_MHZ)
 
 /* Track and modify states of output pins. */
 static struct {
@@ -57,6 +61,12 @@ static const struct gw_delay factory_delay_params = {
     .index_mask = 200
 };
 
+static struct gw_precomp precomp_params;
+static const struct gw_precomp factory_precomp_params = {
+    .range = { { .cyl = 0xffff }, { .cyl = 0xffff },
+               { .cyl = 0xffff }, { .cyl = 0xffff } }
+};
+
 extern uint8_t u_buf[];
 
 #if MCU == STM32F1
@@ -70,8 +80,15 @@ extern uint8_t u_buf[];
 static struct index {
     /* Main code can reset this at will. */
     volatile unsigned int count;
-    /* For synchronising index pulse reporting to the RDATA flux stream. */
-    volatile unsigned int rdata_cnt;
+    /* For synchronising index pulse reporting to the RDATA flux stream:
+     * RDATA timer count and flux opcode at each pulse, indexed by
+     * (nr_pulses % ring size). Unlike @count, this includes every hole of
+     * hard-sectored media. */
+    volatile unsigned int nr_pulses;
+    timcnt_t rdata_cnt[8];
+    uint8_t rdata_op[8];
+    /* RDATA timer is armed to start at the next pulse (index_trigger_arm). */
+    volatile bool_t rdata_trig;
     /* Threshold and trigger for detecting a hard-sector index hole. */
     uint32_t hard_sector_thresh; /* hole-to-hole threshold to detect index */
     uint32_t hard_sector_trigger; /* != 0 -> trigger is primed */
@@ -93,6 +110,11 @@ static struct dma_ring {
         uint16_t prod; /* dma_wr: our producer index for flux samples */
         timcnt_t prev_sample; /* dma_rd: previous CCRx sample value */
     };
+    /* Running sample totals. dma_rd: For detecting overrun of buf[].
+     * dma_wr: For tracking write progress (@cons_total counts whole halves
+     * of buf[], in IRQ_wdata_dma()). */
+    uint32_t prod_total, cons_total;
+    bool_t overrun;
     /* DMA ring buffer of timer values (ARR or CCRx). */
     timcnt_t buf[512];
 } dma;
@@ -120,16 +142,61 @@ static struct {
     uint8_t status;
 } flux_op;
 
+/* Read, write: Buffering statistics (GETINFO_FLUX_STATS). */
+static struct gw_flux_stats flux_stats;
+static time_t flux_stats_loop_time;
+
+#define flux_stat_max(f, v) do {                \
+    uint32_t __v = (v);                         \
+    if (__v > flux_stats.last.f)                \
+        flux_stats.last.f = __v;                \
+    if (__v > flux_stats.all.f)                 \
+        flux_stats.all.f = __v;                 \
+} while (0)
+
+#define flux_stat_min(f, v) do {                \
+    uint32_t __v = (v);                         \
+    if (__v < flux_stats.last.f)                \
+        flux_stats.last.f = __v;                \
+    if (__v < flux_stats.all.f)                 \
+        flux_stats.all.f = __v;                 \
+} while (0)
+
+#define flux_stat_add(f, v) do {                \
+    flux_stats.last.f += (v);                   \
+    flux_stats.all.f += (v);                    \
+} while (0)
+
+/* Called once per command, so that a multi-track read or a verified write
+ * is reported as a whole. */
+static void flux_stats_start(void)
+{
+    memset(&flux_stats.last, 0, sizeof(flux_stats.last));
+    flux_stats.last.min_slack = ~0u;
+    flux_stats_loop_time = time_now();
+}
+
+/* Called once per main-loop iteration while a flux operation is active. */
+static void flux_stats_loop(void)
+{
+    time_t now = time_now();
+    uint32_t us = time_diff(flux_stats_loop_time, now) / time_us(1);
+    flux_stat_max(max_loop_us, min_t(uint32_t, us, 0xffff));
+    flux_stats_loop_time = now;
+}
+
 static enum {
     ST_inactive,
     ST_command_wait,
     ST_zlp,
     ST_read_flux,
     ST_read_flux_drain,
+    ST_read_tracks_settle,
     ST_write_flux_wait_data,
     ST_write_flux_wait_index,
     ST_write_flux,
     ST_write_flux_drain,
+    ST_write_verify,
     ST_erase_flux,
     ST_source_bytes,
     ST_sink_bytes,
@@ -392,11 +459,16 @@ static void step_dir_set(bool_t assert)
 #define step_dir_out() step_dir_set(FALSE)
 #define step_dir_in() step_dir_set(TRUE)
 
-static void step_once(void)
+static void step_pulse(void)
 {
     write_pin(step, TRUE);
     delay_us(15);
     write_pin(step, FALSE);
+}
+
+static void step_once(void)
+{
+    step_pulse();
     delay_us(delay_params.step_delay);
 }
 
@@ -543,6 +615,8 @@ static void floppy_flux_end(void)
     }
 
     /* Turn off timers. */
+    index_trigger_disarm();
+    index.rdata_trig = FALSE;
     tim_rdata->ccer = 0;
     tim_rdata->cr1 = 0;
     tim_rdata->sr = 0; /* dummy, drains any pending DMA */
@@ -556,6 +630,10 @@ static void floppy_flux_end(void)
     while ((dma_rdata.cr & DMA_CR_EN) || (dma_wdata.cr & DMA_CR_EN))
         continue;
 
+    /* Disable DMA-event flux processing. */
+    IRQx_disable(irq_rdata_dma);
+    IRQx_disable(irq_wdata_dma);
+
     /* Disable hard-sector index detection. */
     index_set_hard_sector_detection(0);
 }
@@ -643,6 +721,8 @@ void floppy_init(void)
     gw_info.fw_minor = fw_minor;
     gw_info.usb_buf_kb = U_BUF_SZ >> 10;
 
+    flux_stats.all.min_slack = ~0u;
+
     /* Output pins, unbuffered. */
     configure_pin(dir,    GPO_bus);
     configure_pin(step,   GPO_bus);
@@ -667,6 +747,7 @@ void floppy_init(void)
     timer_init(&op_delay.timer, op_delay_timer, NULL);
 
     delay_params = factory_delay_params;
+    precomp_params = factory_precomp_params;
 
     _set_bus_type(BUS_NONE);
 }
@@ -674,10 +755,42 @@ void floppy_init(void)
 struct gw_info gw_info = {
     .is_main_firmware = 1,
     .max_cmd = CMD_MAX,
-    .sample_freq = 72000000u,
+    .sample_freq = DEFAULT_SAMPLE_MHZ * 1000000u,
     .hw_model = MCU
 };
 
+/* PARAMS_SAMPLE: The new clock takes effect from the next flux operation. */
+static uint8_t set_sample_freq(uint32_t freq)
+{
+    unsigned int mhz = freq / 1000000u;
+    if ((freq != mhz * 1000000u) || !sample_mhz_ok(mhz))
+        return ACK_BAD_COMMAND;
+    if (mhz != sample_mhz) {
+        sample_mhz = mhz;
+        gw_info.sample_freq = freq;
+    }
+    return ACK_OKAY;
+}
+
+static uint8_t set_precomp_params(const void *p, unsigned int len)
+{
+    struct gw_precomp pc = precomp_params;
+    unsigned int i;
+
+    memcpy(&pc, p, len);
+    for (i = 0; i < ARRAY_SIZE(pc.range); i++) {
+        /* Ranges are in ascending order, unused ranges last. */
+        if ((i != 0) && (pc.range[i].cyl < pc.range[i-1].cyl))
+            return ACK_BAD_COMMAND;
+        /* A shift must be well within the shortest interval. */
+        if ((pc.range[i].cyl != 0xffff) && pc.range[i].shift_ns
+            && (pc.range[i].shift_ns >= pc.short_ns/2))
+            return ACK_BAD_COMMAND;
+    }
+    precomp_params = pc;
+    return ACK_OKAY;
+}
+
 static void watchdog_kick(void)
 {
     watchdog.deadline = time_now() + time_ms(delay_params.watchdog);
@@ -708,17 +821,122 @@ static void floppy_end_command(void *ack, unsigned int ack_len)
 
 static struct {
     unsigned int nr_index;
+    unsigned int nr_pulse; /* index.nr_pulses consumed so far */
     unsigned int max_index;
     uint32_t max_index_linger;
     time_t deadline;
+    bool_t sram_capture;
+    bool_t irq_encode; /* process flux from the DMA IRQ, too */
+    uint32_t tx_len; /* bytes being transmitted directly from u_buf[] */
+    uint8_t lead; /* first two-byte lead: 250, or 200 if _GW_RF_wide_enc */
+    enum {
+        RD_flux,      /* CMD_READ_FLUX */
+        RD_sectors,   /* CMD_READ_SECTORS */
+        RD_histogram, /* CMD_READ_HISTOGRAM */
+        RD_detect,    /* CMD_DETECT_FORMAT */
+        RD_verify     /* CMD_WRITE_FLUX (_GW_WF_verify) */
+    } mode;
+    struct {
+        uint32_t start, end; /* end == 0 -> no window */
+        int32_t pos; /* ticks from latest index to latest sample */
+        uint32_t skip; /* ticks of discarded flux not yet sent */
+        bool_t cued; /* stream starts at first index pulse */
+    } window;
+    struct nibble_enc nibble;
 } read;
 
+static void _write_bytes(uint32_t prod, const void *p, unsigned int nr)
+{
+    const uint8_t *b = p;
+    while (nr--)
+        u_buf[U_MASK(prod++)] = *b++;
+}
+
 static void _write_28bit(uint32_t x)
 {
-    u_buf[U_MASK(u_prod++)] = 1 | (x << 1);
-    u_buf[U_MASK(u_prod++)] = 1 | (x >> 6);
-    u_buf[U_MASK(u_prod++)] = 1 | (x >> 13);
-    u_buf[U_MASK(u_prod++)] = 1 | (x >> 20);
+    uint8_t b[4];
+    flux_encode_n28(b, x);
+    _write_bytes(u_prod, b, 4);
+    u_prod += 4;
+}
+
+/* Encode one interval into u_buf[]. See flux_stream.h for the encoding. */
+static void _write_flux(uint32_t ticks)
+{
+    uint8_t b[FLUX_MAX_ENC];
+    unsigned int n = flux_encode(b, ticks, read.lead) - b;
+    _write_bytes(u_prod, b, n);
+    u_prod += n;
+}
+
+/* Emit any nibble-stream interval class still awaiting a partner. */
+static void rdata_nibble_flush(void)
+{
+    uint8_t b[1];
+    if (nibble_flush(&read.nibble, b) != b)
+        u_buf[U_MASK(u_prod++)] = b[0];
+}
+
+/* Nibble-encode one interval into u_buf[]. */
+static void rdata_nibble_encode(uint32_t ticks)
+{
+    uint8_t b[NIBBLE_MAX_ENC];
+    unsigned int n = nibble_encode(&read.nibble, b, ticks, read.lead) - b;
+    _write_bytes(u_prod, b, n);
+    u_prod += n;
+}
+
+/* Ticks from @prev to the next index pulse not yet reported to the host,
+ * or ~0 if there is none (up to and including pulse @nr_pulse-1). */
+static uint32_t rdata_index_ticks(timcnt_t prev, unsigned int nr_pulse)
+{
+    if (read.nr_pulse == nr_pulse)
+        return ~0u;
+    return (timcnt_t)(index.rdata_cnt[read.nr_pulse
+                                      & (ARRAY_SIZE(index.rdata_cnt)-1)]
+                      - prev);
+}
+
+/* Report the next pulse: an index hole (FLUXOP_INDEX) or, when reading
+ * hard-sectored media, a sector hole (FLUXOP_SECTOR). */
+static void rdata_write_pulse(uint32_t ticks)
+{
+    uint8_t op = index.rdata_op[read.nr_pulse
+                                & (ARRAY_SIZE(index.rdata_op)-1)];
+    rdata_nibble_flush();
+    u_buf[U_MASK(u_prod++)] = 0xff;
+    u_buf[U_MASK(u_prod++)] = op;
+    _write_28bit(ticks);
+    read.nr_pulse++;
+    if (op == FLUXOP_INDEX)
+        read.nr_index++;
+    /* Defer watchdog while read is progressing (as measured by index
+     * pulses).  */
+    watchdog_kick();
+}
+
+/* Find out where the DMA engine's producer index has got to. This must be
+ * called at least once per ring's worth of samples: the DMA half/full
+ * transfer IRQ guarantees this. */
+static uint16_t rdata_dma_prod(void)
+{
+    const uint16_t buf_mask = ARRAY_SIZE(dma.buf) - 1;
+    uint16_t prod = (ARRAY_SIZE(dma.buf) - dma_rdata.ndtr) & buf_mask;
+    dma.prod_total += (uint16_t)(prod - dma.prod_total) & buf_mask;
+    if ((dma.prod_total - dma.cons_total) >= ARRAY_SIZE(dma.buf))
+        dma.overrun = TRUE;
+    flux_stat_max(dma_peak, min_t(uint32_t, dma.prod_total - dma.cons_total,
+                                  ARRAY_SIZE(dma.buf)));
+    return prod;
+}
+
+/* Save our progress for next time. */
+static void rdata_dma_save(uint16_t cons, timcnt_t prev)
+{
+    const uint16_t buf_mask = ARRAY_SIZE(dma.buf) - 1;
+    dma.cons_total += (uint16_t)(cons - dma.cons) & buf_mask;
+    dma.cons = cons;
+    dma.prev_sample = prev;
 }
 
 static void rdata_encode_flux(void)
@@ -726,59 +944,56 @@ static void rdata_encode_flux(void)
     const uint16_t buf_mask = ARRAY_SIZE(dma.buf) - 1;
     uint16_t cons = dma.cons, prod;
     timcnt_t prev = dma.prev_sample, curr, next;
-    uint32_t ticks;
-
-    /* We don't want to race the Index IRQ handler. */
-    IRQ_global_disable();
-
-    /* Find out where the DMA engine's producer index has got to. */
-    prod = (ARRAY_SIZE(dma.buf) - dma_rdata.ndtr) & buf_mask;
-
-    if (read.nr_index != index.count) {
-        /* We have just passed the index mark: Record information about 
-         * the just-completed revolution. */
-        read.nr_index = index.count;
-        ticks = (timcnt_t)(index.rdata_cnt - prev);
-        IRQ_global_enable(); /* we're done reading ISR variables */
-        u_buf[U_MASK(u_prod++)] = 0xff;
-        u_buf[U_MASK(u_prod++)] = FLUXOP_INDEX;
-        _write_28bit(ticks);
-        /* Defer watchdog while read is progressing (as measured by index
-         * pulses).  */
-        watchdog_kick();
+    unsigned int nr_pulse;
+    uint32_t ticks, idx_ticks;
+
+    /* Snapshot index pulses before flux samples: Any sample preceding a
+     * counted pulse is then guaranteed to be in the DMA ring. */
+    nr_pulse = index.nr_pulses;
+    barrier();
+
+    prod = rdata_dma_prod();
+
+    /* Index pulses are merged into the flux stream in timestamp order.
+     * @idx_ticks counts down to the next pulse. If there is none, it counts
+     * down from ~0, which a single batch of samples cannot reach. */
+    idx_ticks = rdata_index_ticks(prev, nr_pulse);
+
+    if (read.nibble.quantum) {
+        /* Process the flux timings into a nibble-encoded stream. */
+        for (; cons != prod; cons = (cons+1) & buf_mask) {
+            next = dma.buf[cons];
+            curr = next - prev;
+            while (unlikely(curr >= idx_ticks)) {
+                rdata_write_pulse(idx_ticks);
+                idx_ticks = rdata_index_ticks(prev, nr_pulse);
+            }
+            prev = next;
+            idx_ticks -= curr;
+            if (curr != 0)
+                rdata_nibble_encode(curr);
+        }
     }
 
-    IRQ_global_enable();
-
     /* Process the flux timings into the raw bitcell buffer. */
     for (; cons != prod; cons = (cons+1) & buf_mask) {
         next = dma.buf[cons];
         curr = next - prev;
-        prev = next;
-
-        ticks = curr;
-
-        if (ticks == 0) {
-            /* 0: Skip. */
-        } else if (ticks < 250) {
-            /* 1-249: One byte. */
-            u_buf[U_MASK(u_prod++)] = ticks;
-        } else {
-            unsigned int high = (ticks-250) / 255;
-            if (high < 5) {
-                /* 250-1524: Two bytes. */
-                u_buf[U_MASK(u_prod++)] = 250 + high;
-                u_buf[U_MASK(u_prod++)] = 1 + ((ticks-250) % 255);
-            } else {
-                /* 1525-(2^28-1): Seven bytes. */
-                u_buf[U_MASK(u_prod++)] = 0xff;
-                u_buf[U_MASK(u_prod++)] = FLUXOP_SPACE;
-                _write_28bit(ticks - 249);
-                u_buf[U_MASK(u_prod++)] = 249;
-            }
+        while (unlikely(curr >= idx_ticks)) {
+            rdata_write_pulse(idx_ticks);
+            idx_ticks = rdata_index_ticks(prev, nr_pulse);
         }
+        prev = next;
+        idx_ticks -= curr;
+        /* 0: Skip. */
+        if (curr != 0)
+            _write_flux(curr);
     }
 
+    /* Remaining pulses follow all flux samples received so far. */
+    while (read.nr_pulse != nr_pulse)
+        rdata_write_pulse(rdata_index_ticks(prev, nr_pulse));
+
     /* If it has been a long time since the last flux timing, transfer some of
      * the accumulated time to the host in a "long gap" sample. This avoids
      * timing overflow and, because we take care to keep @prev well behind the
@@ -786,81 +1001,1216 @@ static void rdata_encode_flux(void)
     curr = tim_rdata->cnt - prev;
     if (unlikely(curr > sample_us(400))) {
         ticks = sample_us(200);
+        rdata_nibble_flush();
         u_buf[U_MASK(u_prod++)] = 0xff;
         u_buf[U_MASK(u_prod++)] = FLUXOP_SPACE;
         _write_28bit(ticks);
         prev += ticks;
     }
-
-    /* Save our progress for next time. */
-    dma.cons = cons;
-    dma.prev_sample = prev;
+
+    rdata_dma_save(cons, prev);
+}
+
+/* Windowed read: Flux outside the window is discarded by folding its time
+ * into the next flux interval that is sent. The host's sample cursor is
+ * thus unaffected. */
+
+static void rdata_window_emit(uint32_t ticks)
+{
+    if (read.nibble.quantum)
+        rdata_nibble_encode(ticks);
+    else
+        _write_flux(ticks);
+}
+
+static void rdata_window_pulse(uint32_t ticks)
+{
+    uint8_t op = index.rdata_op[read.nr_pulse
+                                & (ARRAY_SIZE(index.rdata_op)-1)];
+    if (read.window.cued && (read.nr_index == 0)) {
+        /* Index-cued read: The stream starts at the first index pulse. Any
+         * earlier sector holes are discarded along with the flux. */
+        if (op != FLUXOP_INDEX) {
+            read.nr_pulse++;
+            return;
+        }
+        read.window.skip = -ticks;
+    }
+    rdata_write_pulse(read.window.skip + ticks);
+    if (op == FLUXOP_INDEX)
+        read.window.pos = -(int32_t)ticks;
+}
+
+static void rdata_window_flux(uint32_t ticks)
+{
+    read.window.skip += ticks;
+    if (read.window.pos < (int32_t)read.window.end)
+        read.window.pos += ticks;
+    if ((read.nr_index != 0)
+        && (read.window.pos >= (int32_t)read.window.start)
+        && (read.window.pos < (int32_t)read.window.end)) {
+        rdata_window_emit(read.window.skip);
+        read.window.skip = 0;
+    }
+}
+
+static void rdata_encode_window(void)
+{
+    const uint16_t buf_mask = ARRAY_SIZE(dma.buf) - 1;
+    uint16_t cons = dma.cons, prod;
+    timcnt_t prev = dma.prev_sample, curr, next;
+    unsigned int nr_pulse;
+    uint32_t idx_ticks;
+
+    /* As for rdata_encode_flux(). */
+    nr_pulse = index.nr_pulses;
+    barrier();
+
+    prod = rdata_dma_prod();
+
+    idx_ticks = rdata_index_ticks(prev, nr_pulse);
+
+    for (; cons != prod; cons = (cons+1) & buf_mask) {
+        next = dma.buf[cons];
+        curr = next - prev;
+        while (unlikely(curr >= idx_ticks)) {
+            rdata_window_pulse(idx_ticks);
+            idx_ticks = rdata_index_ticks(prev, nr_pulse);
+        }
+        prev = next;
+        idx_ticks -= curr;
+        if (curr != 0)
+            rdata_window_flux(curr);
+    }
+
+    while (read.nr_pulse != nr_pulse)
+        rdata_window_pulse(rdata_index_ticks(prev, nr_pulse));
+
+    /* Long gaps are folded into the next flux interval, like any other
+     * discarded time. Send the discarded time before it can overflow the
+     * 28-bit stream encoding. */
+    curr = tim_rdata->cnt - prev;
+    if (unlikely(curr > sample_us(400))) {
+        read.window.skip += sample_us(200);
+        if (read.window.pos < (int32_t)read.window.end)
+            read.window.pos += sample_us(200);
+        prev += sample_us(200);
+    }
+    if (unlikely((int32_t)read.window.skip >= (1 << 27))) {
+        if (!read.window.cued || (read.nr_index != 0)) {
+            rdata_nibble_flush();
+            u_buf[U_MASK(u_prod++)] = 0xff;
+            u_buf[U_MASK(u_prod++)] = FLUXOP_SPACE;
+            _write_28bit(read.window.skip);
+        }
+        read.window.skip = 0;
+    }
+
+    rdata_dma_save(cons, prev);
+}
+
+static uint8_t floppy_read_prep(const struct gw_read_flux *rf)
+{
+    bool_t sram_capture = !!(rf->flags & m(_GW_RF_sram_capture));
+    bool_t nibble_enc = !!(rf->flags & m(_GW_RF_nibble_enc));
+    bool_t cued_trig;
+
+    if (nibble_enc && (rf->nibble.quantum == 0))
+        return ACK_BAD_COMMAND;
+
+    if (rf->window_end && ((rf->window_start >= rf->window_end)
+                           || (rf->window_end > (1u << 30))))
+        return ACK_BAD_COMMAND;
+
+    /* An unbounded read can never be captured in its entirety. */
+    if (sram_capture && !rf->ticks && !rf->max_index)
+        return ACK_OUT_OF_SRAM;
+
+    op_delay_wait(DELAY_read);
+
+    /* Prepare Timer & DMA. */
+    dma_rdata.mar = (uint32_t)(unsigned long)dma.buf;
+    dma_rdata.ndtr = ARRAY_SIZE(dma.buf);    
+    rdata_prep();
+
+    /* DMA soft state. */
+    dma.cons = 0;
+    dma.prev_sample = tim_rdata->cnt;
+    dma.prod_total = dma.cons_total = 0;
+    dma.overrun = FALSE;
+
+    /* Start Timer. An index-cued read is started by the index pulse itself,
+     * where the INDEX pin can trigger the RDATA Timer. Otherwise, and with
+     * hard-sectored media, the stream is aligned to the index timestamp. */
+    cued_trig = (index_trigger_available
+                 && (rf->flags & m(_GW_RF_index_cued))
+                 && !rf->hard_sector_ticks);
+    if (!cued_trig)
+        tim_rdata->cr1 = TIM_CR1_CEN;
+
+    index_set_hard_sector_detection(rf->hard_sector_ticks);
+    index.count = index.nr_pulses = 0;
+    if (cued_trig) {
+        index.rdata_trig = TRUE;
+        barrier();
+        index_trigger_arm();
+    }
+    usb_packet.ready = FALSE;
+
+    floppy_state = ST_read_flux;
+    flux_op.start = time_now();
+    flux_op.status = ACK_OKAY;
+    memset(&read, 0, sizeof(read));
+    read.max_index = rf->max_index ?: INT_MAX;
+    read.deadline = flux_op.start;
+    read.deadline += rf->ticks ? time_from_samples(rf->ticks) : INT_MAX;
+    read.max_index_linger = time_from_samples(rf->max_index_linger);
+    read.sram_capture = sram_capture;
+    read.irq_encode = !!(rf->flags & m(_GW_RF_irq_encode));
+    read.lead = (rf->flags & m(_GW_RF_wide_enc)) ? 200 : 250;
+    read.window.start = rf->window_start;
+    read.window.end = rf->window_end;
+    if (rf->flags & m(_GW_RF_index_cued)) {
+        /* Cued reads use the windowed encoder. If no window is specified,
+         * the window is effectively unbounded. */
+        read.window.cued = TRUE;
+        if (!read.window.end)
+            read.window.end = 1u << 30;
+    }
+    if (nibble_enc) {
+        read.nibble.quantum = rf->nibble.quantum;
+        /* Classed intervals must be unambiguous. */
+        read.nibble.tolerance = min_t(uint32_t, rf->nibble.tolerance,
+                                      (rf->nibble.quantum - 1) / 2);
+    }
+
+    IRQx_set_prio(irq_rdata_dma, FLUX_IRQ_PRI);
+    IRQx_clear_pending(irq_rdata_dma);
+    IRQx_enable(irq_rdata_dma);
+
+    return ACK_OKAY;
+}
+
+/* Per-command state of sector decode, histogram, detection and write verify.
+ * These are never in progress together, so their state shares storage. */
+
+#include "sec_decode.h"
+
+#define MAX_HIST_BINS 64
+
+struct hist {
+    uint8_t nr_bins, shift;
+    /* Ticks from the most recent index pulse to the latest flux sample. */
+    int32_t rev_ticks;
+    uint32_t bin[MAX_HIST_BINS];
+};
+
+#define DETECT_BINS 128
+
+struct detect {
+    uint32_t bin_ticks;
+    uint32_t nr_samples;
+    uint16_t bin[DETECT_BINS];
+};
+
+#define VERIFY_HEAD 16 /* intervals used to locate the written flux */
+/* With terminate_at_index, the written flux is located no sooner than this
+ * after the index pulse, leaving time to turn the write around. */
+#define VERIFY_HEAD_US 2000
+/* Re-read intervals buffered in idle u_buf[] while locating. */
+#define VERIFY_RBUF 192
+#define verify_rbuf ((uint32_t *)u_buf)
+
+struct verify {
+    bool_t active;
+    enum {
+        V_record,     /* write in progress */
+        V_wait_index, /* re-read: awaiting first index */
+        V_locate,     /* re-read: buffering intervals to locate written flux */
+        V_compare,    /* re-read: comparing blocks */
+        V_done
+    } phase;
+    uint32_t tolerance;
+    unsigned int shift; /* block is 1<<shift intervals */
+    unsigned int pos; /* intervals in current block */
+    unsigned int nr_blocks, blk;
+    unsigned int nr_head, nr_rbuf;
+    bool_t started; /* first interval recorded */
+    uint32_t head_at; /* earliest ticks from write start to the head */
+    unsigned int head_pos; /* intervals before the head */
+    unsigned int nr_skip; /* re-read: intervals to the first block end */
+    uint8_t pending; /* last compared block: 0=none, 1=good, 2=mismatch */
+    uint32_t first; /* ticks from write start to the head's transition */
+    uint32_t acc; /* current block sum */
+    uint32_t min_x; /* shortest written interval */
+    uint32_t ratio; /* re-read speed relative to write, 16.16 fixed point */
+    bool_t anchored; /* current block starts at a re-read transition */
+    uint32_t carry; /* ticks of sample-counter wrap protection */
+    int32_t t; /* re-read: ticks from index to latest sample */
+    int32_t t0; /* re-read: ticks from index to rbuf[0] sample */
+    int32_t start; /* re-read: ticks from index to current block start */
+    int32_t exp; /* re-read: ticks from index to expected block end */
+    struct gw_verify res;
+    uint32_t head[VERIFY_HEAD];
+    uint32_t block[VERIFY_BLOCKS];
+};
+
+static union {
+    struct secdec secdec;
+    struct hist hist;
+    struct detect detect;
+    struct verify verify;
+} rd;
+
+/* Sector decode (CMD_READ_SECTORS): IBM FM/MFM, see sec_decode.c. */
+
+#include "sec_decode.c"
+
+/* At each index pulse: Have we seen every sector with good data? */
+static void sec_check_done(void)
+{
+    bool_t done;
+    unsigned int i;
+
+    /* A full revolution must have passed without finding a new sector. */
+    done = ((read.nr_index >= 2)
+            && (rd.secdec.nr_sectors != 0)
+            && (rd.secdec.nr_sectors == rd.secdec.nr_sectors_at_index));
+    rd.secdec.nr_sectors_at_index = rd.secdec.nr_sectors;
+
+    for (i = 0; done && (i < rd.secdec.nr_sectors); i++)
+        done = (rd.secdec.sectors[i].state == SEC_good);
+
+    /* Bring the index limit forward: The read now ends as normal. */
+    rd.secdec.done = done;
+    if (done && (read.max_index != INT_MAX))
+        read.max_index = read.nr_index;
+}
+
+static void rdata_decode_sectors(void)
+{
+    const uint16_t buf_mask = ARRAY_SIZE(dma.buf) - 1;
+    uint16_t cons = dma.cons, prod;
+    timcnt_t prev = dma.prev_sample, curr, next;
+
+    prod = rdata_dma_prod();
+
+    if (read.nr_index != index.count) {
+        read.nr_index = index.count;
+        watchdog_kick();
+        if (rd.secdec.until_good)
+            sec_check_done();
+    }
+
+    for (; cons != prod; cons = (cons+1) & buf_mask) {
+        next = dma.buf[cons];
+        curr = next - prev;
+        prev = next;
+        if (curr != 0)
+            sec_flux(curr);
+    }
+
+    /* As for rdata_encode_flux(): Consume long gaps before the sample
+     * counter can wrap. There is nothing to decode in them. */
+    curr = tim_rdata->cnt - prev;
+    if (unlikely(curr > sample_us(400))) {
+        sec_flux(sample_us(200));
+        prev += sample_us(200);
+    }
+
+    rdata_dma_save(cons, prev);
+}
+
+/* Report sectors for which we found a good ID but no good data. */
+static void rdata_sectors_finish(void)
+{
+    struct gw_sector hdr;
+    struct sector *sec;
+    unsigned int i;
+
+    for (i = 0; i < rd.secdec.nr_sectors; i++) {
+        sec = &rd.secdec.sectors[i];
+        if (sec->state == SEC_good)
+            continue;
+        if ((U_BUF_SZ - (uint32_t)(u_prod - u_cons)) <= sizeof(hdr))
+            break;
+        hdr.flags = m(_GW_SF_valid)
+            | ((sec->state == SEC_bad_data) ? m(_GW_SF_bad_data) : 0);
+        memcpy(&hdr.c, sec->id, 4);
+        _write_bytes(u_prod, &hdr, sizeof(hdr));
+        u_prod += sizeof(hdr);
+    }
+}
+
+/* Read until good, but the revolution budget has run out with decoding
+ * incomplete (perhaps with no sector found at all): Report the unresolved
+ * sectors, then switch to an index-cued raw flux read of one further
+ * revolution. Returns FALSE if there is nothing to do. */
+static bool_t rdata_sectors_flux_fallback(void)
+{
+    struct gw_sector hdr = { .flags = m(_GW_SF_valid) | m(_GW_SF_flux) };
+
+    if (!rd.secdec.until_good || rd.secdec.done)
+        return FALSE;
+
+    rdata_sectors_finish();
+    _write_bytes(u_prod, &hdr, sizeof(hdr));
+    u_prod += sizeof(hdr);
+
+    read.mode = RD_flux;
+    read.nr_index = 0;
+    read.nr_pulse = index.nr_pulses;
+    read.max_index = 2;
+    read.deadline = time_now() + INT_MAX;
+    read.window.start = read.window.pos = read.window.skip = 0;
+    read.window.end = 1u << 30;
+    read.window.cued = TRUE;
+
+    return TRUE;
+}
+
+static uint8_t floppy_read_sectors_prep(const struct gw_read_sectors *rs)
+{
+    struct gw_read_flux rf = {
+        .max_index = rs->revs,
+        .max_index_linger = sample_us(500)
+    };
+    uint8_t rc;
+
+    if ((rs->encoding > SECENC_IBM_MFM) || !rs->revs || !rs->cell_ticks)
+        return ACK_BAD_COMMAND;
+
+    flux_stats_start();
+    if ((rc = floppy_read_prep(&rf)) != ACK_OKAY)
+        return rc;
+
+    memset(&rd.secdec, 0, sizeof(rd.secdec));
+    rd.secdec.encoding = rs->encoding;
+    rd.secdec.clock = rd.secdec.clock_centre = (int32_t)rs->cell_ticks << 8;
+    rd.secdec.until_good = !!(rs->flags & m(_GW_RS_until_good));
+    read.mode = RD_sectors;
+
+    return ACK_OKAY;
+}
+
+/* Flux interval histogram (CMD_READ_HISTOGRAM). */
+
+static void hist_write_rev(uint32_t rev_ticks)
+{
+    unsigned int i;
+
+    _write_bytes(u_prod, &rev_ticks, 4);
+    u_prod += 4;
+    for (i = 0; i < rd.hist.nr_bins; i++) {
+        _write_bytes(u_prod, &rd.hist.bin[i], 4);
+        u_prod += 4;
+    }
+}
+
+/* An index pulse occurs @ticks after the latest flux sample: Report the
+ * just-completed revolution, if we observed all of it. */
+static void hist_index(uint32_t ticks)
+{
+    read.nr_pulse++;
+    if (read.nr_index++ != 0)
+        hist_write_rev(rd.hist.rev_ticks + ticks);
+    memset(rd.hist.bin, 0, sizeof(rd.hist.bin));
+    rd.hist.rev_ticks = -(int32_t)ticks;
+    watchdog_kick();
+}
+
+static void rdata_histogram(void)
+{
+    const uint16_t buf_mask = ARRAY_SIZE(dma.buf) - 1;
+    uint16_t cons = dma.cons, prod;
+    timcnt_t prev = dma.prev_sample, curr, next;
+    unsigned int nr_pulse, last_bin = rd.hist.nr_bins - 1;
+    uint32_t idx_ticks;
+
+    nr_pulse = index.nr_pulses;
+    barrier();
+
+    prod = rdata_dma_prod();
+
+    /* Index pulses are merged with the flux samples as in
+     * rdata_encode_flux(). */
+    idx_ticks = rdata_index_ticks(prev, nr_pulse);
+
+    for (; cons != prod; cons = (cons+1) & buf_mask) {
+        next = dma.buf[cons];
+        curr = next - prev;
+        while (unlikely(curr >= idx_ticks)) {
+            hist_index(idx_ticks);
+            idx_ticks = rdata_index_ticks(prev, nr_pulse);
+        }
+        prev = next;
+        idx_ticks -= curr;
+        rd.hist.rev_ticks += curr;
+        if (curr != 0)
+            rd.hist.bin[min_t(unsigned int, curr >> rd.hist.shift,
+                              last_bin)]++;
+    }
+
+    while (read.nr_pulse != nr_pulse)
+        hist_index(rdata_index_ticks(prev, nr_pulse));
+
+    /* Consume long gaps before the sample counter can wrap. */
+    curr = tim_rdata->cnt - prev;
+    if (unlikely(curr > sample_us(400))) {
+        rd.hist.rev_ticks += sample_us(200);
+        prev += sample_us(200);
+    }
+
+    rdata_dma_save(cons, prev);
+}
+
+static uint8_t floppy_read_histogram_prep(const struct gw_read_histogram *rh)
+{
+    /* One extra index pulse: the first marks the start of revolution 1. */
+    struct gw_read_flux rf = {
+        .max_index = rh->revs + 1
+    };
+    uint8_t rc;
+
+    if (!rh->revs || !rh->nr_bins || (rh->nr_bins > MAX_HIST_BINS)
+        || (rh->shift >= 32))
+        return ACK_BAD_COMMAND;
+
+    flux_stats_start();
+    if ((rc = floppy_read_prep(&rf)) != ACK_OKAY)
+        return rc;
+
+    memset(&rd.hist, 0, sizeof(rd.hist));
+    rd.hist.nr_bins = rh->nr_bins;
+    rd.hist.shift = rh->shift;
+    read.mode = RD_histogram;
+
+    return ACK_OKAY;
+}
+
+/* Format detection (CMD_DETECT_FORMAT): A fine-grained histogram of flux
+ * intervals is collected, and the shortest interval clusters are matched
+ * against the interval patterns of each supported encoding. */
+
+struct detect_peak {
+    uint32_t pos; /* centroid, in half-bins */
+    uint32_t weight;
+};
+
+static void detect_sample(uint32_t ticks)
+{
+    uint32_t i = ticks / rd.detect.bin_ticks;
+    rd.detect.nr_samples++;
+    if ((i < DETECT_BINS) && (++rd.detect.bin[i] == 0xffff)) {
+        /* Saturated: Halve everything to preserve the distribution. */
+        for (i = 0; i < DETECT_BINS; i++)
+            rd.detect.bin[i] >>= 1;
+        rd.detect.nr_samples >>= 1;
+    }
+}
+
+static void rdata_detect(void)
+{
+    const uint16_t buf_mask = ARRAY_SIZE(dma.buf) - 1;
+    uint16_t cons = dma.cons, prod;
+    timcnt_t prev = dma.prev_sample, curr, next;
+
+    prod = rdata_dma_prod();
+
+    for (; cons != prod; cons = (cons+1) & buf_mask) {
+        next = dma.buf[cons];
+        curr = next - prev;
+        prev = next;
+        if (curr != 0)
+            detect_sample(curr);
+    }
+
+    /* Consume long gaps before the sample counter can wrap. */
+    curr = tim_rdata->cnt - prev;
+    if (unlikely(curr > sample_us(400)))
+        prev += sample_us(200);
+
+    rdata_dma_save(cons, prev);
+}
+
+/* Find up to @max clusters of significant interval counts, shortest first. */
+static unsigned int detect_peaks(struct detect_peak *peak, unsigned int max)
+{
+    uint32_t thresh = 0, total = 0, sum, weight;
+    unsigned int i, nr = 0;
+
+    for (i = 0; i < DETECT_BINS; i++) {
+        thresh = max_t(uint32_t, thresh, rd.detect.bin[i]);
+        total += rd.detect.bin[i];
+    }
+    thresh /= 8;
+
+    for (i = 0; (i < DETECT_BINS) && (nr < max); i++) {
+        if (rd.detect.bin[i] <= thresh)
+            continue;
+        sum = weight = 0;
+        for (; (i < DETECT_BINS) && (rd.detect.bin[i] > thresh); i++) {
+            sum += rd.detect.bin[i] * (2*i+1);
+            weight += rd.detect.bin[i];
+        }
+        if (weight < total/32)
+            continue;
+        peak[nr].pos = sum / weight;
+        peak[nr].weight = weight;
+        nr++;
+    }
+
+    return nr;
+}
+
+/* Is there a peak within 1/8 of @ratio/2 times the first peak? */
+static bool_t detect_has_peak(const struct detect_peak *peak,
+                              unsigned int nr, unsigned int ratio)
+{
+    uint32_t target = peak[0].pos * ratio / 2;
+    unsigned int i;
+
+    for (i = 1; i < nr; i++) {
+        int32_t delta = peak[i].pos - target;
+        if ((delta < 0 ? -delta : delta) <= target/8)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+static void rdata_detect_finish(void)
+{
+    static const uint8_t min_cells[] = {
+        [FMTENC_FM] = 1, [FMTENC_MFM] = 2, [FMTENC_GCR] = 1 };
+    static const uint8_t max_cells[] = {
+        [FMTENC_FM] = 2, [FMTENC_MFM] = 4, [FMTENC_GCR] = 3 };
+    struct gw_format fmt = { .encoding = FMTENC_unknown };
+    struct detect_peak peak[4];
+    uint32_t cell, x, k, sx = 0, sk = 0, matched = 0;
+    unsigned int i, nr;
+
+    nr = detect_peaks(peak, ARRAY_SIZE(peak));
+    if (nr < 2)
+        goto out;
+
+    if (detect_has_peak(peak, nr, 3)) {
+        fmt.encoding = FMTENC_MFM;
+        cell = peak[0].pos / 2;
+    } else if (detect_has_peak(peak, nr, 6)) {
+        fmt.encoding = FMTENC_GCR;
+        cell = peak[0].pos;
+    } else if (detect_has_peak(peak, nr, 4)) {
+        fmt.encoding = FMTENC_FM;
+        cell = peak[0].pos;
+    } else {
+        goto out;
+    }
+    if (cell == 0)
+        goto unknown;
+
+    /* Refine the cell period over all intervals which match the encoding.
+     * All quantities are in half-bins. */
+    for (i = 0; i < DETECT_BINS; i++) {
+        x = 2*i+1;
+        k = (x + cell/2) / cell;
+        if ((k < min_cells[fmt.encoding]) || (k > max_cells[fmt.encoding])
+            || ((x > k*cell) ? (x - k*cell) : (k*cell - x)) > cell/4)
+            continue;
+        sx += rd.detect.bin[i] * x;
+        sk += rd.detect.bin[i] * k;
+        matched += rd.detect.bin[i];
+    }
+
+    if (sk == 0)
+        goto unknown;
+
+    fmt.cell_ticks = ((sx / sk) * rd.detect.bin_ticks
+                      + (sx % sk) * rd.detect.bin_ticks / sk) / 2;
+    fmt.confidence = min_t(uint32_t,
+                           matched * 100 / rd.detect.nr_samples, 100);
+    goto out;
+
+unknown:
+    fmt.encoding = FMTENC_unknown;
+out:
+    _write_bytes(u_prod, &fmt, sizeof(fmt));
+    u_prod += sizeof(fmt);
+}
+
+static uint8_t floppy_detect_format_prep(const struct gw_detect_format *df)
+{
+    struct gw_read_flux rf = {
+        .ticks = df->ticks
+    };
+    uint8_t rc;
+
+    if (!df->ticks)
+        return ACK_BAD_COMMAND;
+
+    flux_stats_start();
+    if ((rc = floppy_read_prep(&rf)) != ACK_OKAY)
+        return rc;
+
+    memset(&rd.detect, 0, sizeof(rd.detect));
+    rd.detect.bin_ticks = max_t(uint32_t, sample_ns(125), 1);
+    read.mode = RD_detect;
+
+    return ACK_OKAY;
+}
+
+/* Multi-track read (CMD_READ_TRACKS). */
+
+static struct {
+    bool_t active;
+    struct gw_track trk;
+    int16_t cyl_last;
+    uint8_t head_first, head_last;
+    uint16_t revs;
+    unsigned int step_nr; /* steps still to issue */
+    int step_dir; /* +1 = inward, -1 = outward, 0 = not yet set */
+} tracks;
+
+static void floppy_set_head(uint8_t head)
+{
+    if (read_pin(head) != head) {
+        op_delay_wait(DELAY_head);
+        write_pin(head, head);
+        op_delay_async(DELAY_write, delay_params.pre_write);
+    }
+}
+
+/* Seek and select head for the first track. */
+static uint8_t tracks_seek(void)
+{
+    uint8_t rc = floppy_seek(tracks.trk.cyl);
+    if (rc == ACK_OKAY)
+        floppy_set_head(tracks.trk.head);
+    return rc;
+}
+
+/* Start the seek to a subsequent track. Nothing is driven here: steps,
+ * and the settle delay which follows them, are issued from
+ * ST_read_tracks_settle as each delay expires, so that earlier tracks keep
+ * draining to the host. */
+static uint8_t tracks_step_start(void)
+{
+    struct unit *u;
+    int cyl = tracks.trk.cyl;
+
+    if (unit_nr < 0)
+        return ACK_NO_UNIT;
+    u = &unit[unit_nr];
+
+    if (cyl < (u->is_flippy ? -8 : 0))
+        return ACK_BAD_CYLINDER;
+
+    tracks.step_nr = (u->cyl < cyl) ? cyl - u->cyl : u->cyl - cyl;
+    tracks.step_dir = 0;
+    if (tracks.step_nr == 0)
+        floppy_set_head(tracks.trk.head);
+
+    return ACK_OKAY;
+}
+
+/* Issue the next step, if the previous seek or step delay has expired. The
+ * first step sets the step direction. On the final step, the settle delay
+ * is started and the head is selected. */
+static void tracks_step(void)
+{
+    struct unit *u = &unit[unit_nr];
+
+    if (op_delay.mask & DELAY_seek)
+        return;
+
+    if (tracks.step_dir == 0) {
+        if (u->cyl < tracks.trk.cyl) {
+            tracks.step_dir = 1;
+            step_dir_in();
+        } else {
+            if (tracks.trk.cyl < 0)
+                flippy_trk0_sensor_disable();
+            tracks.step_dir = -1;
+            step_dir_out();
+        }
+    }
+
+    step_pulse();
+    u->cyl += tracks.step_dir;
+
+    if (--tracks.step_nr != 0) {
+        op_delay_async(DELAY_seek, delay_params.step_delay);
+        return;
+    }
+
+    flippy_trk0_sensor_enable();
+    op_delay_async(DELAY_read | DELAY_write | DELAY_seek,
+                   delay_params.step_delay
+                   + delay_params.seek_settle * 1000u);
+    floppy_set_head(tracks.trk.head);
+}
+
+static void tracks_track_end(uint8_t status);
+
+static void tracks_read_start(void)
+{
+    struct gw_read_flux rf = {
+        .max_index = tracks.revs,
+        .max_index_linger = sample_us(500)
+    };
+    uint32_t tx_len = read.tx_len;
+    uint8_t rc;
+
+    _write_bytes(u_prod, &tracks.trk, sizeof(tracks.trk));
+    u_prod += sizeof(tracks.trk);
+
+    rc = floppy_read_prep(&rf);
+    read.tx_len = tx_len;
+    if (rc != ACK_OKAY)
+        tracks_track_end(rc);
+}
+
+/* Current track is done: Append its trailer and move to the next track. */
+static void tracks_track_end(uint8_t status)
+{
+    u_buf[U_MASK(u_prod++)] = 0; /* EOStream */
+    u_buf[U_MASK(u_prod++)] = status;
+    flux_op.status = status;
+    floppy_state = ST_read_flux_drain;
+
+    if (status != ACK_OKAY)
+        goto out;
+
+    if (tracks.trk.head++ == tracks.head_last) {
+        if (tracks.trk.cyl++ == tracks.cyl_last)
+            goto out;
+        tracks.trk.head = tracks.head_first;
+    }
+
+    status = tracks_step_start();
+    if (status != ACK_OKAY) {
+        /* Report the failed track, with an empty flux stream. */
+        _write_bytes(u_prod, &tracks.trk, sizeof(tracks.trk));
+        u_prod += sizeof(tracks.trk);
+        tracks_track_end(status);
+        return;
+    }
+
+    floppy_state = ST_read_tracks_settle;
+    return;
+
+out:
+    tracks.active = FALSE;
+}
+
+static uint8_t floppy_read_tracks_prep(const struct gw_read_tracks *rt)
+{
+    uint8_t rc;
+
+    if (!rt->revs || (rt->cyl_first > rt->cyl_last)
+        || (rt->head_first > rt->head_last) || (rt->head_last > 1))
+        return ACK_BAD_COMMAND;
+
+    memset(&tracks, 0, sizeof(tracks));
+    tracks.trk.cyl = rt->cyl_first;
+    tracks.trk.head = tracks.head_first = rt->head_first;
+    tracks.cyl_last = rt->cyl_last;
+    tracks.head_last = rt->head_last;
+    tracks.revs = rt->revs;
+
+    if ((rc = tracks_seek()) != ACK_OKAY)
+        return rc;
+
+    flux_stats_start();
+    memset(&read, 0, sizeof(read));
+    tracks.active = TRUE;
+    flux_op.status = ACK_OKAY;
+    floppy_state = ST_read_tracks_settle;
+
+    return ACK_OKAY;
+}
+
+static void make_read_packet(unsigned int n)
+{
+    unsigned int c = U_MASK(u_cons);
+    unsigned int l = U_BUF_SZ - c;
+    if (l < n) {
+        memcpy(usb_packet.data, &u_buf[c], l);
+        memcpy(&usb_packet.data[l], u_buf, n-l);
+    } else {
+        memcpy(usb_packet.data, &u_buf[c], n);
+    }
+    u_cons += n;
+    usb_packet.ready = TRUE;
+    usb_packet.len = n;
+}
+
+/* Write verify (_GW_WF_verify): The written intervals are recorded as
+ * block sums, halving the resolution whenever the record fills. The track
+ * is then re-read for one revolution, from the index pulse which ended the
+ * write if possible: a few written intervals (the head) locate the written
+ * flux, and thereafter blocks are compared in turn. A block boundary is
+ * the re-read transition nearest its expected time, scaled by the measured
+ * drive speed: the block matches if it holds the written number of
+ * intervals and its boundary is within tolerance. */
+
+static void verify_record(const timcnt_t *tbuf, unsigned int nr)
+{
+    unsigned int i, j;
+    uint32_t x;
+
+    for (i = 0; i < nr; i++) {
+        x = (uint32_t)tbuf[i] + 1;
+        if (!rd.verify.started) {
+            rd.verify.started = TRUE;
+            rd.verify.first = x;
+            continue;
+        }
+        if (rd.verify.first < rd.verify.head_at) {
+            /* Before the head: Its transition is later. */
+            rd.verify.first += x;
+            rd.verify.head_pos++;
+        } else if (rd.verify.nr_head < VERIFY_HEAD) {
+            rd.verify.head[rd.verify.nr_head++] = x;
+        }
+        if (!rd.verify.min_x || (x < rd.verify.min_x))
+            rd.verify.min_x = x;
+        rd.verify.acc += x;
+        if (++rd.verify.pos < (1u << rd.verify.shift))
+            continue;
+        rd.verify.block[rd.verify.nr_blocks++] = rd.verify.acc;
+        rd.verify.acc = rd.verify.pos = 0;
+        if (rd.verify.nr_blocks == VERIFY_BLOCKS) {
+            /* Record is full: Merge block pairs. */
+            for (j = 0; j < VERIFY_BLOCKS/2; j++)
+                rd.verify.block[j] = (rd.verify.block[2*j]
+                                      + rd.verify.block[2*j+1]);
+            rd.verify.nr_blocks = VERIFY_BLOCKS/2;
+            rd.verify.shift++;
+        }
+    }
+}
+
+static void verify_commit(void)
+{
+    struct gw_verify *res = &rd.verify.res;
+    uint32_t off = (rd.verify.blk - 1) << rd.verify.shift;
+
+    if (!rd.verify.pending)
+        return;
+    res->nr_blocks++;
+    if (rd.verify.pending == 2) {
+        res->nr_mismatch++;
+        if (res->first_mismatch == ~0u)
+            res->first_mismatch = off;
+        res->last_mismatch = off;
+    }
+    rd.verify.pending = 0;
+}
+
+static uint32_t verify_scale(uint32_t x)
+{
+    return ((uint64_t)x * rd.verify.ratio) >> 16;
+}
+
+static void verify_block_end(bool_t good, int32_t end)
+{
+    verify_commit();
+    rd.verify.pending = good ? 1 : 2;
+    rd.verify.start = end;
+    rd.verify.pos = 0;
+
+    if (++rd.verify.blk == rd.verify.nr_blocks) {
+        verify_commit();
+        rd.verify.phase = V_done;
+        return;
+    }
+
+    rd.verify.exp = end + verify_scale(rd.verify.block[rd.verify.blk]);
+}
+
+/* Compare blocks from @blk, starting at the latest re-read transition. */
+static void verify_compare_start(void)
+{
+    rd.verify.pos = 0;
+    rd.verify.start = rd.verify.t;
+    rd.verify.anchored = TRUE;
+    rd.verify.exp = rd.verify.t + verify_scale(rd.verify.block[rd.verify.blk]);
+}
+
+static void verify_compare(uint32_t x)
+{
+    uint32_t want, r;
+    int32_t win, delta;
+    bool_t good;
+
+    if (rd.verify.phase != V_compare)
+        return;
+
+    rd.verify.t += x;
+
+    /* Located mid-block: Count intervals to the first whole block. */
+    if (rd.verify.nr_skip) {
+        if (--rd.verify.nr_skip == 0)
+            verify_compare_start();
+        return;
+    }
+
+    rd.verify.pos++;
+    win = rd.verify.min_x / 2;
+
+    /* No re-read transition near the expected block end: The block is a
+     * mismatch, and the next is timed from where this one should end. */
+    while (rd.verify.t > rd.verify.exp + win) {
+        rd.verify.anchored = FALSE;
+        verify_block_end(FALSE, rd.verify.exp);
+        if (rd.verify.phase != V_compare)
+            return;
+        rd.verify.pos = 1;
+    }
+
+    if (rd.verify.t < rd.verify.exp - win)
+        return;
+
+    /* This transition ends the block. Missing or extra transitions show in
+     * the interval count; the boundary time catches drifted intervals. */
+    want = rd.verify.block[rd.verify.blk];
+    delta = rd.verify.t - rd.verify.exp;
+    if (delta < 0)
+        delta = -delta;
+    good = ((rd.verify.pos == (1u << rd.verify.shift))
+            && (delta <= (int32_t)(rd.verify.tolerance + want/256)));
+
+    /* Track drive speed from good blocks with a re-read start transition. */
+    if (good && rd.verify.anchored) {
+        r = udiv64((uint64_t)(rd.verify.t - rd.verify.start) << 16, want);
+        rd.verify.ratio += ((int32_t)(r - rd.verify.ratio)) / 8;
+    }
+
+    rd.verify.anchored = TRUE;
+    verify_block_end(good, rd.verify.t);
+}
+
+/* Find the first written flux transition among the buffered intervals: It
+ * must be near its time from index, and be followed by the first written
+ * intervals. */
+static void verify_locate(void)
+{
+    struct gw_verify *res = &rd.verify.res;
+    int32_t t = rd.verify.t0, t_max = rd.verify.first + sample_us(100);
+    unsigned int i, j;
+    uint32_t delta;
+
+    for (i = 0; i + rd.verify.nr_head < rd.verify.nr_rbuf; i++) {
+        if (i != 0)
+            t += verify_rbuf[i];
+        if (t > t_max)
+            break;
+        for (j = 0; j < rd.verify.nr_head; j++) {
+            uint32_t x = verify_rbuf[i+1+j], want = rd.verify.head[j];
+            delta = (x > want) ? x - want : want - x;
+            if (delta > rd.verify.tolerance)
+                break;
+        }
+        if (j == rd.verify.nr_head) {
+            /* Blocks are compared from the first to start at or after the
+             * head. */
+            rd.verify.phase = V_compare;
+            rd.verify.t = t;
+            rd.verify.ratio = 1u << 16;
+            rd.verify.blk = ((rd.verify.head_pos + (1u << rd.verify.shift) - 1)
+                             >> rd.verify.shift);
+            rd.verify.nr_skip = ((rd.verify.blk << rd.verify.shift)
+                                 - rd.verify.head_pos);
+            if (rd.verify.blk >= rd.verify.nr_blocks)
+                rd.verify.phase = V_done;
+            else if (rd.verify.nr_skip == 0)
+                verify_compare_start();
+            for (j = i+1; j < rd.verify.nr_rbuf; j++)
+                verify_compare(verify_rbuf[j]);
+            return;
+        }
+    }
+
+    /* Not found: Every block is a mismatch. */
+    res->nr_blocks = res->nr_mismatch = rd.verify.nr_blocks;
+    res->first_mismatch = 0;
+    res->last_mismatch = (rd.verify.nr_blocks - 1) << rd.verify.shift;
+    rd.verify.phase = V_done;
+}
+
+static void verify_sample(uint32_t x)
+{
+    x += rd.verify.carry;
+    rd.verify.carry = 0;
+
+    switch (rd.verify.phase) {
+    case V_locate:
+        rd.verify.t += x;
+        if (rd.verify.t < (int32_t)(rd.verify.first - sample_us(100)))
+            break;
+        if (rd.verify.nr_rbuf == 0)
+            rd.verify.t0 = rd.verify.t;
+        verify_rbuf[rd.verify.nr_rbuf++] = x;
+        if (rd.verify.nr_rbuf == VERIFY_RBUF)
+            verify_locate();
+        break;
+    case V_compare:
+        verify_compare(x);
+        break;
+    default:
+        break;
+    }
+}
+
+/* An index pulse occurs @ticks after the latest flux sample. */
+static void verify_index(uint32_t ticks)
+{
+    read.nr_pulse++;
+    read.nr_index++;
+    if (rd.verify.phase == V_wait_index) {
+        /* @ticks is measured from the sample counter, which has already
+         * skipped @carry: The next interval includes it. */
+        rd.verify.phase = V_locate;
+        rd.verify.t = -(int32_t)(ticks + rd.verify.carry);
+    } else {
+        /* End of revolution: The last completed block is compared, but a
+         * partial block may span the write splice. */
+        if (rd.verify.phase == V_locate)
+            verify_locate();
+        verify_commit();
+        rd.verify.phase = V_done;
+    }
+    watchdog_kick();
 }
 
-static uint8_t floppy_read_prep(const struct gw_read_flux *rf)
+static void rdata_verify(void)
 {
-    op_delay_wait(DELAY_read);
+    const uint16_t buf_mask = ARRAY_SIZE(dma.buf) - 1;
+    uint16_t cons = dma.cons, prod;
+    timcnt_t prev = dma.prev_sample, curr, next;
+    unsigned int nr_pulse;
+    uint32_t idx_ticks;
 
-    /* Prepare Timer & DMA. */
-    dma_rdata.mar = (uint32_t)(unsigned long)dma.buf;
-    dma_rdata.ndtr = ARRAY_SIZE(dma.buf);    
-    rdata_prep();
+    nr_pulse = index.nr_pulses;
+    barrier();
 
-    /* DMA soft state. */
-    dma.cons = 0;
-    dma.prev_sample = tim_rdata->cnt;
+    prod = rdata_dma_prod();
 
-    /* Start Timer. */
-    tim_rdata->cr1 = TIM_CR1_CEN;
+    /* Index pulses are merged with the flux samples as in
+     * rdata_encode_flux(). */
+    idx_ticks = rdata_index_ticks(prev, nr_pulse);
 
-    index.count = 0;
-    usb_packet.ready = FALSE;
+    for (; cons != prod; cons = (cons+1) & buf_mask) {
+        next = dma.buf[cons];
+        curr = next - prev;
+        while (unlikely(curr >= idx_ticks)) {
+            verify_index(idx_ticks);
+            idx_ticks = rdata_index_ticks(prev, nr_pulse);
+        }
+        prev = next;
+        idx_ticks -= curr;
+        if ((curr != 0) && (rd.verify.phase != V_done))
+            verify_sample(curr);
+    }
 
-    floppy_state = ST_read_flux;
-    flux_op.start = time_now();
-    flux_op.status = ACK_OKAY;
-    memset(&read, 0, sizeof(read));
-    read.max_index = rf->max_index ?: INT_MAX;
-    read.deadline = flux_op.start;
-    read.deadline += rf->ticks ? time_from_samples(rf->ticks) : INT_MAX;
-    read.max_index_linger = time_from_samples(rf->max_index_linger);
+    while (read.nr_pulse != nr_pulse)
+        verify_index(rdata_index_ticks(prev, nr_pulse));
 
-    return ACK_OKAY;
+    /* Consume long gaps before the sample counter can wrap. */
+    curr = tim_rdata->cnt - prev;
+    if (unlikely(curr > sample_us(400))) {
+        /* The next sample's interval includes the skipped time. */
+        rd.verify.carry += sample_us(200);
+        prev += sample_us(200);
+    }
+
+    rdata_dma_save(cons, prev);
 }
 
-static void make_read_packet(unsigned int n)
+static void rdata_process(void)
 {
-    unsigned int c = U_MASK(u_cons);
-    unsigned int l = U_BUF_SZ - c;
-    if (l < n) {
-        memcpy(usb_packet.data, &u_buf[c], l);
-        memcpy(&usb_packet.data[l], u_buf, n-l);
-    } else {
-        memcpy(usb_packet.data, &u_buf[c], n);
+    switch (read.mode) {
+    case RD_flux:
+        if (read.window.end)
+            rdata_encode_window();
+        else
+            rdata_encode_flux();
+        break;
+    case RD_sectors:
+        rdata_decode_sectors();
+        break;
+    case RD_histogram:
+        rdata_histogram();
+        break;
+    case RD_detect:
+        rdata_detect();
+        break;
+    case RD_verify:
+        rdata_verify();
+        break;
     }
-    u_cons += n;
-    usb_packet.ready = TRUE;
-    usb_packet.len = n;
+}
+
+/* DMA half/full transfer: Keep track of the producer so that ring overrun
+ * is detected, and optionally process the new flux samples right away,
+ * regardless of main-loop latency. */
+static void IRQ_rdata_dma(void)
+{
+    dma_rdata_clear_irq();
+    if (read.irq_encode)
+        rdata_process();
+    else
+        (void)rdata_dma_prod();
+}
+
+/* WDATA DMA half/full transfer: Count consumed samples, so that write
+ * progress is known regardless of main-loop latency. */
+static void IRQ_wdata_dma(void)
+{
+    dma_wdata_clear_irq();
+    dma.cons_total += ARRAY_SIZE(dma.buf)/2;
 }
 
 static void floppy_read(void)
 {
-    unsigned int avail = (uint32_t)(u_prod - u_cons);
+    unsigned int avail;
+    uint32_t oldpri;
+
+    /* Data sent directly from u_buf[] is consumed only once the endpoint
+     * has finished with it. */
+    if (read.tx_len && ep_tx_ready(EP_TX)) {
+        u_cons += read.tx_len;
+        read.tx_len = 0;
+    }
+
+    avail = (uint32_t)(u_prod - u_cons);
 
     if (floppy_state == ST_read_flux) {
 
-        rdata_encode_flux();
+        oldpri = IRQ_save(FLUX_IRQ_PRI);
+        rdata_process();
+        IRQ_restore(oldpri);
         avail = (uint32_t)(u_prod - u_cons);
 
-        if (avail > U_BUF_SZ) {
+        flux_stat_max(u_buf_peak, avail);
+        if (avail <= U_BUF_SZ)
+            flux_stat_min(min_slack, U_BUF_SZ - avail);
+
+        if ((avail > U_BUF_SZ) || dma.overrun) {
 
             /* Overflow */
-            printk("OVERFLOW %u %u %u %u\n", u_cons, u_prod,
-                   usb_packet.ready, ep_tx_ready(EP_TX));
+            printk("OVERFLOW %u %u %u %u %u\n", u_cons, u_prod,
+                   read.tx_len, ep_tx_ready(EP_TX), dma.overrun);
             floppy_flux_end();
-            flux_op.status = ACK_FLUX_OVERFLOW;
+            flux_op.status = (read.sram_capture && !dma.overrun)
+                ? ACK_OUT_OF_SRAM : ACK_FLUX_OVERFLOW;
             floppy_state = ST_read_flux_drain;
-            u_cons = u_prod = avail = 0;
+            /* Unsent data may be overwritten, including that of earlier
+             * tracks: The whole command is aborted. */
+            tracks.active = FALSE;
+            u_cons = u_prod = read.tx_len = 0;
+            avail = (uint32_t)(u_prod - u_cons);
 
         } else if (read.nr_index >= read.max_index) {
 
@@ -873,11 +2223,25 @@ static void floppy_read(void)
 
         }
 
-        else if (time_since(read.deadline) >= 0) {
+        else if ((time_since(read.deadline) >= 0)
+                   && (read.mode == RD_sectors)
+                   && rdata_sectors_flux_fallback()) {
+
+            /* Unresolved sectors: The read continues, as raw flux. */
+
+        } else if (time_since(read.deadline) >= 0) {
 
             /* Deadline is reached: End the read now. */
             floppy_flux_end();
+            if (read.mode == RD_sectors)
+                rdata_sectors_finish();
+            else if (read.mode == RD_detect)
+                rdata_detect_finish();
+            else
+                rdata_nibble_flush();
             floppy_state = ST_read_flux_drain;
+            if (tracks.active)
+                tracks_track_end(ACK_OKAY);
 
         } else if ((index.count == 0)
                    && (read.max_index != INT_MAX)
@@ -888,33 +2252,64 @@ static void floppy_read(void)
             floppy_flux_end();
             flux_op.status = ACK_NO_INDEX;
             floppy_state = ST_read_flux_drain;
-            u_cons = u_prod = avail = 0;
+            if (tracks.active)
+                tracks_track_end(flux_op.status);
+            else
+                u_cons = u_prod = read.tx_len = 0;
+            avail = (uint32_t)(u_prod - u_cons);
 
         }
 
+    } else if (floppy_state == ST_read_tracks_settle) {
+
+        /* Step to the next track, then start it once the drive has
+         * settled. */
+        if (tracks.step_nr)
+            tracks_step();
+        else if (!(op_delay.mask & DELAY_read))
+            tracks_read_start();
+
     } else if ((avail < usb_bulk_mps)
-               && !usb_packet.ready
+               && !read.tx_len
                && ep_tx_ready(EP_TX)) {
 
         /* Final packet, including ACK byte (NUL). */
         memset(usb_packet.data, 0, usb_bulk_mps);
         make_read_packet(avail);
+        flux_stat_add(usb_packets, 1);
         floppy_state = ST_command_wait;
         floppy_end_command(usb_packet.data, avail+1);
         return; /* FINISHED */
 
     }
 
-    if (!usb_packet.ready && (avail >= usb_bulk_mps))
-        make_read_packet(usb_bulk_mps);
+    /* An SRAM capture is sent only after the read has completed. */
+    if (read.sram_capture && (floppy_state == ST_read_flux))
+        return;
 
-    if (usb_packet.ready && ep_tx_ready(EP_TX)) {
-        usb_write(EP_TX, usb_packet.data, usb_packet.len);
-        usb_packet.ready = FALSE;
+    if (!read.tx_len && (avail >= usb_bulk_mps) && ep_tx_ready(EP_TX)) {
+        unsigned int c = U_MASK(u_cons);
+        if (c + usb_bulk_mps <= U_BUF_SZ) {
+            /* Transmit straight from the ring, as many whole packets as
+             * we have, up to the end of the ring. Reads start at u_cons=0
+             * and U_BUF_SZ is a multiple of MPS, so this is the usual
+             * case. */
+            unsigned int n = min_t(unsigned int, avail, U_BUF_SZ - c);
+            n = min_t(unsigned int, n, usb_max_xfer());
+            n -= n % usb_bulk_mps;
+            usb_write_xfer(EP_TX, &u_buf[c], n);
+            flux_stat_add(usb_packets, n / usb_bulk_mps);
+            read.tx_len = n;
+        } else {
+            /* Packet wraps the ring: Bounce it via usb_packet. */
+            make_read_packet(usb_bulk_mps);
+            usb_write(EP_TX, usb_packet.data, usb_packet.len);
+            flux_stat_add(usb_packets, 1);
+            usb_packet.ready = FALSE;
+        }
     }
 }
 
-
 /*
  * WRITE PATH
  */
@@ -923,6 +2318,7 @@ static struct {
     bool_t is_finished;
     bool_t cue_at_index;
     bool_t terminate_at_index;
+    bool_t preload; /* whole stream in u_buf[] before writing starts */
     uint32_t astable_period;
     uint32_t ticks;
     enum {
@@ -930,16 +2326,185 @@ static struct {
         FLUXMODE_oneshot, /* generating a single flux */
         FLUXMODE_astable  /* generating a region of oscillating flux */
     } flux_mode;
+    struct {
+        uint32_t quantum; /* 0 -> standard stream encoding */
+        uint8_t pending; /* second interval class of last byte (or 0) */
+        bool_t escape; /* next interval is in standard stream encoding */
+    } nibble;
+    struct {
+        uint32_t cell_ticks; /* 0 -> flux stream (CMD_WRITE_FLUX) */
+        uint32_t todo; /* cells not yet loaded into @bits */
+        uint32_t rx_todo; /* stream bytes not yet received */
+        uint32_t bits; /* cells awaiting decode, left-aligned */
+        unsigned int nr; /* number of valid cells in @bits */
+    } bitcells;
+    struct {
+        uint32_t shift; /* 0 -> no precompensation */
+        uint32_t short_ticks;
+        uint32_t held; /* interval awaiting its successor (0 -> none) */
+        int32_t prev_shift; /* shift applied to start of @held */
+    } precomp;
+    struct {
+        bool_t active; /* bitcells generated by fmt_next() */
+        bool_t mfm;
+        bool_t host_data; /* sector data comes from host (_GW_FT_data) */
+        bool_t prev; /* previous MFM data bit */
+        uint8_t step; /* FS_* */
+        uint8_t sec; /* current sector */
+        uint8_t nr_sectors;
+        uint8_t gap4a, gap1, gap2, gap3;
+        uint8_t fill;
+        uint16_t data_len;
+        uint16_t pos; /* bytes generated in current step */
+        uint16_t crc;
+        /* The track is written once the DMA consumer passes the final gap's
+         * first flux, which is sample number @end_total of the write. */
+        uint32_t end_total;
+        bool_t in_gap;
+    } fmt;
 } write;
 
 static uint32_t _read_28bit(void)
 {
-    uint32_t x;
-    x  = (u_buf[U_MASK(u_cons++)]       ) >>  1;
-    x |= (u_buf[U_MASK(u_cons++)] & 0xfe) <<  6;
-    x |= (u_buf[U_MASK(u_cons++)] & 0xfe) << 13;
-    x |= (u_buf[U_MASK(u_cons++)] & 0xfe) << 20;
-    return x;
+    uint8_t b[4];
+    unsigned int i;
+    for (i = 0; i < 4; i++)
+        b[i] = u_buf[U_MASK(u_cons++)];
+    return flux_decode_n28(b);
+}
+
+/* Track format (CMD_FORMAT_TRACK): Sequence of steps, each a run of bytes. */
+enum {
+    FS_gap4a, FS_iam_sync, FS_iam, FS_gap1,
+    FS_id_sync, FS_idam, FS_id, FS_id_crc, FS_gap2,
+    FS_dat_sync, FS_dam, FS_dat, FS_dat_crc, FS_gap3,
+    FS_gap4b
+};
+
+static unsigned int fmt_step_len(void)
+{
+    switch (write.fmt.step) {
+    case FS_gap4a: return write.fmt.gap4a;
+    case FS_gap1: return write.fmt.gap1;
+    case FS_gap2: return write.fmt.gap2;
+    case FS_gap3: return write.fmt.gap3;
+    case FS_iam_sync: case FS_id_sync: case FS_dat_sync:
+        return write.fmt.mfm ? 12 : 6;
+    case FS_iam: case FS_idam: case FS_dam:
+        return write.fmt.mfm ? 4 : 1;
+    case FS_id: return 4;
+    case FS_id_crc: case FS_dat_crc: return 2;
+    case FS_dat: return write.fmt.data_len;
+    }
+    return ~0u; /* FS_gap4b: until index */
+}
+
+/* Encode a byte as 16 bitcells. FM @clock bits are normally all ones. */
+static uint16_t fmt_encode(uint8_t b, uint8_t clock)
+{
+    uint16_t cells = 0;
+    unsigned int i;
+
+    for (i = 0; i < 8; i++) {
+        bool_t d = (b >> 7) & 1;
+        cells <<= 2;
+        if (write.fmt.mfm) {
+            cells |= ((!write.fmt.prev && !d) << 1) | d;
+            write.fmt.prev = d;
+        } else {
+            cells |= (((clock >> 7) & 1) << 1) | d;
+            clock <<= 1;
+        }
+        b <<= 1;
+    }
+
+    return cells;
+}
+
+static uint8_t fmt_crc_byte(uint8_t b)
+{
+    write.fmt.crc = crc16_ccitt(&b, 1, write.fmt.crc);
+    return b;
+}
+
+/* Address mark: MFM A1/C2 syncs with a missing clock, then the mark byte;
+ * FM mark byte with a missing-clock pattern. */
+static uint16_t fmt_mark(uint8_t mark)
+{
+    uint8_t sync = (mark == 0xfc) ? 0xc2 : 0xa1;
+
+    if (!write.fmt.mfm) {
+        write.fmt.crc = 0xffff;
+        return fmt_encode(fmt_crc_byte(mark), (mark == 0xfc) ? 0xd7 : 0xc7);
+    }
+
+    if (write.fmt.pos < 3) {
+        write.fmt.prev = sync & 1;
+        return (sync == 0xc2) ? 0x5224 : 0x4489;
+    }
+
+    write.fmt.crc = 0xcdb4; /* CRC of A1,A1,A1 */
+    return fmt_encode(fmt_crc_byte(mark), 0xff);
+}
+
+/* Next 16 bitcells of the formatted track, or -1 if awaiting host data. */
+static int fmt_next(void)
+{
+    uint8_t gap = write.fmt.mfm ? 0x4e : 0xff;
+    uint16_t cells;
+
+    while (write.fmt.pos >= fmt_step_len()) {
+        write.fmt.pos = 0;
+        if (write.fmt.step != FS_gap3) {
+            write.fmt.step++;
+        } else if (++write.fmt.sec < write.fmt.nr_sectors) {
+            write.fmt.step = FS_id_sync;
+        } else {
+            /* All host data consumed: Fill to the index pulse. */
+            write.fmt.step = FS_gap4b;
+            write.is_finished = TRUE;
+        }
+    }
+
+    switch (write.fmt.step) {
+    case FS_iam:
+        cells = fmt_mark(0xfc);
+        break;
+    case FS_idam:
+        cells = fmt_mark(0xfe);
+        break;
+    case FS_dam:
+        cells = fmt_mark(0xfb);
+        break;
+    case FS_iam_sync: case FS_id_sync: case FS_dat_sync:
+        cells = fmt_encode(0x00, 0xff);
+        break;
+    case FS_id:
+        if (u_cons == u_prod)
+            return -1;
+        cells = fmt_encode(fmt_crc_byte(u_buf[U_MASK(u_cons++)]), 0xff);
+        break;
+    case FS_dat:
+        if (!write.fmt.host_data) {
+            cells = fmt_encode(fmt_crc_byte(write.fmt.fill), 0xff);
+        } else if (u_cons == u_prod) {
+            return -1;
+        } else {
+            cells = fmt_encode(fmt_crc_byte(u_buf[U_MASK(u_cons++)]), 0xff);
+        }
+        break;
+    case FS_id_crc: case FS_dat_crc:
+        cells = fmt_encode(write.fmt.pos ? write.fmt.crc : write.fmt.crc >> 8,
+                           0xff);
+        break;
+    default: /* gaps */
+        cells = fmt_encode(gap, 0xff);
+        break;
+    }
+
+    if (write.fmt.step != FS_gap4b)
+        write.fmt.pos++;
+    return cells;
 }
 
 static unsigned int _wdata_decode_flux(timcnt_t *tbuf, unsigned int nr)
@@ -996,26 +2561,92 @@ static unsigned int _wdata_decode_flux(timcnt_t *tbuf, unsigned int nr)
 
     }
 
-    while (u_cons != u_prod) {
+    while ((u_cons != u_prod) || write.nibble.pending
+           || write.bitcells.cell_ticks) {
 
         ASSERT(write.flux_mode == FLUXMODE_idle);
 
-        x = u_buf[U_MASK(u_cons)];
-        if (x == 0) {
+        if (write.bitcells.cell_ticks) {
+            /* Bitcell stream: Time to the next 1 cell. */
+            unsigned int n;
+            if (write.bitcells.nr == 0) {
+                if (write.fmt.active) {
+                    int cells = fmt_next();
+                    if (cells < 0)
+                        goto out;
+                    if (write.is_finished && !write.fmt.in_gap) {
+                        /* Entered the final gap. Any interval held back
+                         * by precompensation is output first. */
+                        write.fmt.end_total = (dma.prod_total + nr - todo
+                                               + !!write.precomp.held);
+                        write.fmt.in_gap = TRUE;
+                    }
+                    write.bitcells.bits = (uint32_t)cells << 16;
+                    n = 16;
+                } else {
+                    if (write.bitcells.todo == 0) {
+                        /* Trailing 0 cells need no flux. */
+                        write.is_finished = TRUE;
+                        goto out;
+                    }
+                    if (u_cons == u_prod)
+                        goto out;
+                    n = min_t(uint32_t, write.bitcells.todo, 8);
+                    write.bitcells.bits =
+                        (uint32_t)u_buf[U_MASK(u_cons++)] << 24;
+                    write.bitcells.bits &= ~0u << (32 - n);
+                    write.bitcells.todo -= n;
+                }
+                write.bitcells.nr = n;
+            }
+            if (write.bitcells.bits == 0) {
+                /* No 1 cells left in this byte. */
+                ticks += write.bitcells.nr * write.bitcells.cell_ticks;
+                write.bitcells.nr = 0;
+                continue;
+            }
+            n = __builtin_clz(write.bitcells.bits) + 1;
+            write.bitcells.bits <<= n;
+            write.bitcells.nr -= n;
+            x = n * write.bitcells.cell_ticks;
+        } else if (write.nibble.pending) {
+            /* Nibble stream: Second interval class of previous byte. */
+            x = write.nibble.pending * write.nibble.quantum;
+            write.nibble.pending = 0;
+        } else if ((x = u_buf[U_MASK(u_cons)]) == 0) {
             /* 0: Terminate */
             u_cons++;
             write.is_finished = TRUE;
             goto out;
+        } else if (write.nibble.quantum && !write.nibble.escape
+                   && (x != 0xff)) {
+            /* Nibble stream: One or two interval classes. */
+            unsigned int hi;
+            int lo = nibble_decode(x, &hi);
+            u_cons++;
+            if (lo < 0)
+                goto error;
+            if (hi == 15) {
+                /* Exact interval follows in standard encoding. */
+                write.nibble.escape = TRUE;
+                if (lo == 0)
+                    continue;
+            } else {
+                write.nibble.pending = hi;
+            }
+            x = lo * write.nibble.quantum;
         } else if (x < 250) {
-            /* 1-249: One byte. Time to next flux.*/
+            /* 1-249: One byte. Time to next flux. Write streams always use
+             * the standard encoding (lead 250). */
             u_cons++;
+            write.nibble.escape = FALSE;
         } else if (x < 255) {
             /* 250-254: Two bytes. Time to next flux. */
             if ((uint32_t)(u_prod - u_cons) < 2)
                 goto out;
             u_cons++;
-            x = 250 + (x - 250) * 255;
-            x += u_buf[U_MASK(u_cons++)] - 1;
+            x = flux_decode2(x, u_buf[U_MASK(u_cons++)], 250);
+            write.nibble.escape = FALSE;
         } else {
             /* 255: Six bytes */
             uint8_t op;
@@ -1076,10 +2707,76 @@ error:
     goto out;
 }
 
+static void precomp_prep(void)
+{
+    unsigned int i;
+    uint16_t shift_ns = 0;
+    int cyl;
+
+    if ((unit_nr < 0) || !unit[unit_nr].initialised)
+        return;
+    cyl = unit[unit_nr].cyl;
+
+    for (i = 0; i < ARRAY_SIZE(precomp_params.range); i++) {
+        if (precomp_params.range[i].cyl > cyl)
+            break;
+        shift_ns = precomp_params.range[i].shift_ns;
+    }
+
+    write.precomp.shift = sample_ns(shift_ns);
+    write.precomp.short_ticks = sample_ns(precomp_params.short_ns);
+}
+
+/* Apply write precompensation to @nr timer values at @tbuf, in place. Each
+ * interval is held back until its successor is known, so the output lags
+ * the input by one value. @room bounds the output, which can grow by one
+ * when the final interval is flushed. Returns the number of values output. */
+/* An adjusted interval, clamped to what the WDATA timer can produce. */
+static timcnt_t precomp_ticks(int32_t x)
+{
+    x = max_t(int32_t, x, MIN_PULSE);
+    return min_t(uint32_t, x - 1, (timcnt_t)-1);
+}
+
+static unsigned int wdata_precomp(timcnt_t *tbuf, unsigned int nr,
+                                  unsigned int room)
+{
+    uint32_t cur, next, s = write.precomp.short_ticks;
+    unsigned int i, out = 0;
+    int32_t shift;
+
+    for (i = 0; i < nr; i++) {
+        next = tbuf[i] + 1;
+        cur = write.precomp.held;
+        write.precomp.held = next;
+        if (cur == 0)
+            continue;
+        shift = 0;
+        if ((cur < 2*s) && (next < 2*s)) {
+            if ((cur < s) && (next >= s))
+                shift = -write.precomp.shift; /* early */
+            else if ((cur >= s) && (next < s))
+                shift = write.precomp.shift; /* late */
+        }
+        tbuf[out++] = precomp_ticks(cur + shift - write.precomp.prev_shift);
+        write.precomp.prev_shift = shift;
+    }
+
+    /* End of stream: Flush the final interval. */
+    if (write.is_finished && !write.fmt.active && write.precomp.held
+        && (out < room)) {
+        cur = write.precomp.held;
+        write.precomp.held = 0;
+        tbuf[out++] = precomp_ticks(cur - write.precomp.prev_shift);
+    }
+
+    return out;
+}
+
 static void wdata_decode_flux(void)
 {
     const uint16_t buf_mask = ARRAY_SIZE(dma.buf) - 1;
-    uint16_t nr_to_wrap, nr_to_cons, nr, dmacons;
+    uint16_t nr_to_wrap, nr_to_cons, nr, n, dmacons;
 
     /* Find out where the DMA engine's consumer index has got to. */
     dmacons = (ARRAY_SIZE(dma.buf) - dma_wdata.ndtr) & buf_mask;
@@ -1091,8 +2788,16 @@ static void wdata_decode_flux(void)
 
     /* Now attempt to fill the contiguous stretch with flux data calculated 
      * from buffered bitcell data. */
-    dma.prod += _wdata_decode_flux(&dma.buf[dma.prod], nr);
+    n = _wdata_decode_flux(&dma.buf[dma.prod], nr);
+    if (rd.verify.active)
+        verify_record(&dma.buf[dma.prod], n);
+    if (write.precomp.shift)
+        n = wdata_precomp(&dma.buf[dma.prod], n, nr);
+    dma.prod += n;
     dma.prod &= buf_mask;
+    dma.prod_total += n;
+
+    flux_stat_max(dma_peak, (dma.prod - dmacons) & buf_mask);
 }
 
 static void floppy_process_write_packet(void)
@@ -1103,6 +2808,7 @@ static void floppy_process_write_packet(void)
         usb_read(EP_RX, usb_packet.data, len);
         usb_packet.ready = TRUE;
         usb_packet.len = len;
+        flux_stat_add(usb_packets, 1);
     }
 
     if (usb_packet.ready) {
@@ -1118,13 +2824,26 @@ static void floppy_process_write_packet(void)
                 memcpy(&u_buf[p], usb_packet.data, n);
             }
             u_prod += n;
+            write.bitcells.rx_todo -= min_t(uint32_t,
+                                            write.bitcells.rx_todo, n);
             usb_packet.ready = FALSE;
+            flux_stat_max(u_buf_peak, (uint32_t)(u_prod - u_cons));
         }
     }
 }
 
 static uint8_t floppy_write_prep(const struct gw_write_flux *wf)
 {
+    bool_t nibble_enc = !!(wf->flags & m(_GW_WF_nibble_enc));
+    bool_t verify_enc = !!(wf->flags & m(_GW_WF_verify));
+
+    if (nibble_enc && (wf->nibble.quantum == 0))
+        return ACK_BAD_COMMAND;
+
+    /* Verify locates the written flux relative to the index pulse. */
+    if (verify_enc && (!wf->cue_at_index || wf->hard_sector_ticks))
+        return ACK_BAD_COMMAND;
+
     if (get_wrprot() == LOW)
         return ACK_WRPROT;
 
@@ -1137,6 +2856,7 @@ static uint8_t floppy_write_prep(const struct gw_write_flux *wf)
     /* Initialise DMA ring indexes (consumer index is implicit). */
     dma_wdata.ndtr = ARRAY_SIZE(dma.buf);
     dma.prod = 0;
+    dma.prod_total = dma.cons_total = 0;
 
     usb_packet.ready = FALSE;
 
@@ -1146,9 +2866,82 @@ static uint8_t floppy_write_prep(const struct gw_write_flux *wf)
     write.flux_mode = FLUXMODE_idle;
     write.cue_at_index = wf->cue_at_index;
     write.terminate_at_index = wf->terminate_at_index;
+    write.preload = !!(wf->flags & m(_GW_WF_preload));
+    if (nibble_enc)
+        write.nibble.quantum = wf->nibble.quantum;
+    precomp_prep();
+
+    memset(&rd.verify, 0, sizeof(rd.verify));
+    if (verify_enc) {
+        rd.verify.active = TRUE;
+        rd.verify.phase = V_record;
+        rd.verify.tolerance = wf->verify_tolerance ?: sample_ns(300);
+        if (wf->terminate_at_index)
+            rd.verify.head_at = sample_us(VERIFY_HEAD_US);
+        rd.verify.res.first_mismatch = rd.verify.res.last_mismatch = ~0u;
+    }
 
     index_set_hard_sector_detection(wf->hard_sector_ticks);
 
+    flux_stats_start();
+
+    return ACK_OKAY;
+}
+
+static uint8_t floppy_write_bitcells_prep(const struct gw_write_bitcells *wb)
+{
+    struct gw_write_flux wf = {
+        .cue_at_index = wb->cue_at_index,
+        .terminate_at_index = wb->terminate_at_index,
+        .hard_sector_ticks = wb->hard_sector_ticks
+    };
+    uint8_t rc;
+
+    if ((wb->cell_ticks == 0) || (wb->nr_cells == 0)
+        || (wb->cell_ticks > (1u << 20)))
+        return ACK_BAD_COMMAND;
+
+    if ((rc = floppy_write_prep(&wf)) != ACK_OKAY)
+        return rc;
+
+    write.bitcells.cell_ticks = wb->cell_ticks;
+    write.bitcells.todo = wb->nr_cells;
+    write.bitcells.rx_todo = (wb->nr_cells + 7) / 8;
+
+    return ACK_OKAY;
+}
+
+static uint8_t floppy_format_track_prep(const struct gw_format_track *ft)
+{
+    struct gw_write_flux wf = {
+        .cue_at_index = TRUE,
+        .terminate_at_index = TRUE
+    };
+    bool_t host_data = !!(ft->flags & m(_GW_FT_data));
+    uint16_t data_len = 128u << ft->size_code;
+    uint8_t rc;
+
+    if ((ft->encoding > SECENC_IBM_MFM) || (ft->nr_sectors == 0)
+        || (ft->cell_ticks == 0) || (ft->size_code > 6))
+        return ACK_BAD_COMMAND;
+
+    if ((rc = floppy_write_prep(&wf)) != ACK_OKAY)
+        return rc;
+
+    write.bitcells.cell_ticks = ft->cell_ticks;
+    write.bitcells.rx_todo = ft->nr_sectors * (4 + (host_data ? data_len : 0));
+    write.fmt.active = TRUE;
+    write.fmt.mfm = (ft->encoding == SECENC_IBM_MFM);
+    write.fmt.host_data = host_data;
+    write.fmt.step = ft->gap4a ? FS_gap4a : FS_gap1;
+    write.fmt.nr_sectors = ft->nr_sectors;
+    write.fmt.gap4a = ft->gap4a;
+    write.fmt.gap1 = ft->gap1;
+    write.fmt.gap2 = ft->gap2;
+    write.fmt.gap3 = ft->gap3;
+    write.fmt.fill = ft->fill;
+    write.fmt.data_len = data_len;
+
     return ACK_OKAY;
 }
 
@@ -1170,19 +2963,41 @@ static void floppy_write_wait_data(void)
      * take care because, since we are not yet draining the DMA buffer, the
      * write stream may end without us noticing and setting write.is_finished. 
      * Hence we peek for a NUL byte in the input buffer if it's non-empty. */
-    write_finished = ((u_prod == u_cons)
-                      ? write.is_finished
-                      : (u_buf[U_MASK(u_prod-1)] == 0));
-    if (((dma.prod != (ARRAY_SIZE(dma.buf)-1)) 
-         || ((uint32_t)(u_prod - u_cons) < u_buf_threshold))
-        && !write_finished)
+    if (write.bitcells.cell_ticks)
+        write_finished = (write.bitcells.rx_todo == 0);
+    else
+        write_finished = ((u_prod == u_cons)
+                          ? write.is_finished
+                          : (u_buf[U_MASK(u_prod-1)] == 0));
+    if (write.preload) {
+        /* Wait for the whole stream. If a packet cannot be accepted then
+         * the stream does not fit: Fail before anything is written. */
+        if (!write_finished) {
+            if (usb_packet.ready
+                && ((U_BUF_SZ - (uint32_t)(u_prod - u_cons))
+                    < usb_packet.len)) {
+                flux_op.status = ACK_OUT_OF_SRAM;
+                floppy_state = ST_write_flux_drain;
+            }
+            return;
+        }
+    } else if (((dma.prod != (ARRAY_SIZE(dma.buf)-1)) 
+                || ((uint32_t)(u_prod - u_cons) < u_buf_threshold))
+               && !write_finished) {
         return;
+    }
 
     op_delay_wait(DELAY_write);
 
     floppy_state = ST_write_flux_wait_index;
     flux_op.start = time_now();
 
+    /* Count consumed samples from the start. */
+    dma_wdata_clear_irq();
+    IRQx_set_prio(irq_wdata_dma, FLUX_IRQ_PRI);
+    IRQx_clear_pending(irq_wdata_dma);
+    IRQx_enable(irq_wdata_dma);
+
     /* Enable DMA only after flux values are generated. */
     dma_wdata_start();
 
@@ -1220,11 +3035,19 @@ static void floppy_write_wait_index(void)
 static void floppy_write_check_underflow(void)
 {
     uint32_t avail = u_prod - u_cons;
+    bool_t eos; /* input buffer contains end of stream? */
+
+    if (write.bitcells.cell_ticks)
+        eos = (write.bitcells.rx_todo == 0);
+    else
+        eos = (avail != 0) && (u_buf[U_MASK(u_prod-1)] == 0);
 
-    if (/* We've run the input buffer dry. */
-        (avail == 0)
-        /* The input buffer is nearly dry, and doesn't contain EOStream. */
-        || ((avail < 16) && (u_buf[U_MASK(u_prod-1)] != 0))) {
+    /* The buffer legitimately runs dry at end of stream. */
+    if (!eos)
+        flux_stat_min(min_slack, avail);
+
+    /* The input buffer is dry or nearly so, and doesn't contain EOStream. */
+    if ((avail < 16) && !eos) {
 
         /* Underflow */
         printk("UNDERFLOW %u %u %u %u\n", u_cons, u_prod,
@@ -1236,6 +3059,23 @@ static void floppy_write_check_underflow(void)
     }
 }
 
+/* Samples consumed by the WDATA DMA since the write started. */
+static uint32_t wdata_cons_total(void)
+{
+    const uint16_t half_mask = ARRAY_SIZE(dma.buf)/2 - 1;
+    uint32_t total;
+    uint16_t pos;
+
+    do {
+        total = dma.cons_total;
+        barrier();
+        pos = (ARRAY_SIZE(dma.buf) - dma_wdata.ndtr) & half_mask;
+        barrier();
+    } while (total != dma.cons_total);
+
+    return total + pos;
+}
+
 static void floppy_write(void)
 {
     const uint16_t buf_mask = ARRAY_SIZE(dma.buf) - 1;
@@ -1255,6 +3095,14 @@ static void floppy_write(void)
         return;
     }
 
+    /* Formatted track: Keep filling the final gap until the index pulse. */
+    if (write.fmt.active)
+        return;
+
+    /* Precompensation: Await room in the DMA ring for the final interval. */
+    if (write.precomp.held)
+        return;
+
     /* Wait for DMA ring to drain. */
     todo = ~0;
     do {
@@ -1268,12 +3116,69 @@ static void floppy_write(void)
     } while ((todo != 0) && (todo <= prev_todo));
 
 terminate:
+    /* Formatted track: Were the sectors written before the index pulse? */
+    if (write.fmt.active
+        && (!write.fmt.in_gap
+            || ((int32_t)(wdata_cons_total() - write.fmt.end_total) < 0)))
+        flux_op.status = ACK_FLUX_OVERFLOW;
+    floppy_flux_end();
+    floppy_state = ST_write_flux_drain;
+}
+
+static void floppy_write_verify_start(void)
+{
+    struct gw_read_flux rf = { .max_index = 2 };
+    time_t idx_time = index.trigger_time;
+    int32_t t;
+
+    (void)floppy_read_prep(&rf);
+    read.mode = RD_verify;
+    floppy_state = ST_write_verify;
+
+    /* The written flux starts at an index pulse. If its head has not yet
+     * passed since the latest pulse (the one which terminated the write),
+     * locate it in this revolution. Otherwise await the next pulse. */
+    t = samples_from_time(time_diff(idx_time, flux_op.start));
+    if (t < (int32_t)(rd.verify.first - sample_us(100))) {
+        rd.verify.phase = V_locate;
+        rd.verify.t = t;
+    } else {
+        rd.verify.phase = V_wait_index;
+    }
+    rd.verify.res.block_len = 1u << rd.verify.shift;
+    rd.verify.blk = rd.verify.pending = 0;
+    rd.verify.carry = 0;
+    if (rd.verify.nr_blocks == 0) {
+        /* Nothing to compare. */
+        rd.verify.phase = V_done;
+    }
+}
+
+static void floppy_write_verify(void)
+{
+    uint32_t oldpri;
+
+    oldpri = IRQ_save(FLUX_IRQ_PRI);
+    rdata_process();
+    IRQ_restore(oldpri);
+
+    if (dma.overrun) {
+        flux_op.status = ACK_FLUX_OVERFLOW;
+    } else if (rd.verify.phase != V_done) {
+        /* Timeout if the revolution is not seen within two seconds. */
+        if (time_since(flux_op.start) <= time_ms(2000))
+            return;
+        flux_op.status = ACK_NO_INDEX;
+    }
+
     floppy_flux_end();
     floppy_state = ST_write_flux_drain;
 }
 
 static void floppy_write_drain(void)
 {
+    unsigned int len = 1;
+
     /* Drain the write stream. */
     if (!write.is_finished) {
         floppy_process_write_packet();
@@ -1281,17 +3186,27 @@ static void floppy_write_drain(void)
         return;
     }
 
+    /* Re-read the track, if the write succeeded. */
+    if (rd.verify.active && (rd.verify.phase == V_record)
+        && (flux_op.status == ACK_OKAY)) {
+        floppy_write_verify_start();
+        return;
+    }
+
     /* Wait for space to write ACK usb_packet. */
     if (!ep_tx_ready(EP_TX))
         return;
 
-    /* ACK with Status byte. */
+    /* ACK with Status byte, and verify result if requested. */
     u_buf[0] = flux_op.status;
+    if (rd.verify.active) {
+        memcpy(&u_buf[1], &rd.verify.res, sizeof(rd.verify.res));
+        len += sizeof(rd.verify.res);
+    }
     floppy_state = ST_command_wait;
-    floppy_end_command(u_buf, 1);
+    floppy_end_command(u_buf, len);
 }
 
-
 /*
  * ERASE PATH
  */
@@ -1325,7 +3240,6 @@ static void floppy_erase(void)
     floppy_end_command(u_buf, 1);
 }
 
-
 /*
  * SINK/SOURCE
  */
@@ -1435,7 +3349,6 @@ static void sink_bytes(void)
     }
 }
 
-
 /*
  * BOOTLOADER UPDATE
  */
@@ -1512,7 +3425,6 @@ done:
     floppy_end_command(u_buf, 1);
 }
 
-
 static void process_command(void)
 {
     uint8_t cmd = u_buf[0];
@@ -1541,6 +3453,9 @@ static void process_command(void)
             memcpy(&u_buf[2], &bw, sizeof(bw));
             break;
         }
+        case GETINFO_FLUX_STATS: /* gw_flux_stats */
+            memcpy(&u_buf[2], &flux_stats, sizeof(flux_stats));
+            break;
         case GETINFO_CURRENT_DRIVE:
         case GETINFO_DRIVE(0) ... GETINFO_DRIVE(2): {
             struct gw_drive_info d;
@@ -1581,28 +3496,53 @@ static void process_command(void)
         uint8_t head = u_buf[2];
         if ((len != 3) || (head > 1))
             goto bad_command;
-        if (read_pin(head) != head) {
-            op_delay_wait(DELAY_head);
-            write_pin(head, head);
-            op_delay_async(DELAY_write, delay_params.pre_write);
-        }
+        floppy_set_head(head);
         break;
     }
     case CMD_SET_PARAMS: {
         uint8_t idx = u_buf[2];
-        if ((len < 3) || (idx != PARAMS_DELAYS)
-            || (len > (3 + sizeof(delay_params))))
+        if (len < 3)
             goto bad_command;
-        memcpy(&delay_params, &u_buf[3], len-3);
+        if (idx == PARAMS_DELAYS) {
+            if (len > (3 + sizeof(delay_params)))
+                goto bad_command;
+            memcpy(&delay_params, &u_buf[3], len-3);
+        } else if (idx == PARAMS_PRECOMP) {
+            if (len > (3 + sizeof(precomp_params)))
+                goto bad_command;
+            u_buf[1] = set_precomp_params(&u_buf[3], len-3);
+        } else if (idx == PARAMS_SAMPLE) {
+            struct gw_sample gws;
+            if (len != (3 + sizeof(gws)))
+                goto bad_command;
+            memcpy(&gws, &u_buf[3], sizeof(gws));
+            u_buf[1] = set_sample_freq(gws.sample_freq);
+        } else {
+            goto bad_command;
+        }
         break;
     }
     case CMD_GET_PARAMS: {
         uint8_t idx = u_buf[2];
         uint8_t nr = u_buf[3];
-        if ((len != 4) || (idx != PARAMS_DELAYS)
-            || (nr > sizeof(delay_params)))
+        struct gw_sample gws = { .sample_freq = gw_info.sample_freq };
+        if (len != 4)
+            goto bad_command;
+        if (idx == PARAMS_DELAYS) {
+            if (nr > sizeof(delay_params))
+                goto bad_command;
+            memcpy(&u_buf[2], &delay_params, nr);
+        } else if (idx == PARAMS_PRECOMP) {
+            if (nr > sizeof(precomp_params))
+                goto bad_command;
+            memcpy(&u_buf[2], &precomp_params, nr);
+        } else if (idx == PARAMS_SAMPLE) {
+            if (nr > sizeof(gws))
+                goto bad_command;
+            memcpy(&u_buf[2], &gws, nr);
+        } else {
             goto bad_command;
-        memcpy(&u_buf[2], &delay_params, nr);
+        }
         resp_sz += nr;
         break;
     }
@@ -1621,9 +3561,43 @@ static void process_command(void)
             || (len > (2 + sizeof(rf))))
             goto bad_command;
         memcpy(&rf, &u_buf[2], len-2);
+        flux_stats_start();
         u_buf[1] = floppy_read_prep(&rf);
         goto out;
     }
+    case CMD_READ_SECTORS: {
+        struct gw_read_sectors rs = {};
+        if ((len < (2 + offsetof(struct gw_read_sectors, flags)))
+            || (len > (2 + sizeof(rs))))
+            goto bad_command;
+        memcpy(&rs, &u_buf[2], len-2);
+        u_buf[1] = floppy_read_sectors_prep(&rs);
+        goto out;
+    }
+    case CMD_READ_HISTOGRAM: {
+        struct gw_read_histogram rh;
+        if (len != (2 + sizeof(rh)))
+            goto bad_command;
+        memcpy(&rh, &u_buf[2], sizeof(rh));
+        u_buf[1] = floppy_read_histogram_prep(&rh);
+        goto out;
+    }
+    case CMD_DETECT_FORMAT: {
+        struct gw_detect_format df;
+        if (len != (2 + sizeof(df)))
+            goto bad_command;
+        memcpy(&df, &u_buf[2], sizeof(df));
+        u_buf[1] = floppy_detect_format_prep(&df);
+        goto out;
+    }
+    case CMD_READ_TRACKS: {
+        struct gw_read_tracks rt;
+        if (len != (2 + sizeof(rt)))
+            goto bad_command;
+        memcpy(&rt, &u_buf[2], sizeof(rt));
+        u_buf[1] = floppy_read_tracks_prep(&rt);
+        goto out;
+    }
     case CMD_WRITE_FLUX: {
         struct gw_write_flux wf = {};
         if ((len < (2 + offsetof(struct gw_write_flux, hard_sector_ticks)))
@@ -1633,6 +3607,24 @@ static void process_command(void)
         u_buf[1] = floppy_write_prep(&wf);
         goto out;
     }
+    case CMD_WRITE_BITCELLS: {
+        struct gw_write_bitcells wb = {};
+        if ((len < (2 + offsetof(struct gw_write_bitcells,
+                                 hard_sector_ticks)))
+            || (len > (2 + sizeof(wb))))
+            goto bad_command;
+        memcpy(&wb, &u_buf[2], len-2);
+        u_buf[1] = floppy_write_bitcells_prep(&wb);
+        goto out;
+    }
+    case CMD_FORMAT_TRACK: {
+        struct gw_format_track ft;
+        if (len != (2 + sizeof(ft)))
+            goto bad_command;
+        memcpy(&ft, &u_buf[2], sizeof(ft));
+        u_buf[1] = floppy_format_track_prep(&ft);
+        goto out;
+    }
     case CMD_GET_FLUX_STATUS: {
         if (len != 2)
             goto bad_command;
@@ -1679,6 +3671,8 @@ static void process_command(void)
         if (len != 2)
             goto bad_command;
         delay_params = factory_delay_params;
+        precomp_params = factory_precomp_params;
+        set_sample_freq(DEFAULT_SAMPLE_MHZ * 1000000u);
         _set_bus_type(BUS_NONE);
         reset_user_pins();
         break;
@@ -1752,6 +3746,7 @@ static void floppy_configure(void)
     floppy_flux_end();
     floppy_state = ST_command_wait;
     u_cons = u_prod = 0;
+    tracks.active = FALSE;
     act_led(FALSE);
 }
 
@@ -1788,19 +3783,25 @@ void floppy_process(void)
         break;
 
     case ST_read_flux:
+        flux_stats_loop();
+        /* fall through */
     case ST_read_flux_drain:
+    case ST_read_tracks_settle:
         floppy_read();
         break;
 
     case ST_write_flux_wait_data:
+        flux_stats_loop();
         floppy_write_wait_data();
         break;
 
     case ST_write_flux_wait_index:
+        flux_stats_loop();
         floppy_write_wait_index();
         break;
 
     case ST_write_flux:
+        flux_stats_loop();
         floppy_write();
         break;
 
@@ -1808,6 +3809,11 @@ void floppy_process(void)
         floppy_write_drain();
         break;
 
+    case ST_write_verify:
+        flux_stats_loop();
+        floppy_write_verify();
+        break;
+
     case ST_erase_flux:
         floppy_erase();
         break;
@@ -1844,6 +3850,17 @@ const struct usb_class_ops usb_cdc_acm_ops = {
  * INTERRUPT HANDLERS
  */
 
+/* Queue a pulse for the RDATA flux stream. */
+static void index_report_pulse(timcnt_t cnt, uint8_t op)
+{
+    unsigned int i = index.nr_pulses & (ARRAY_SIZE(index.rdata_cnt)-1);
+    /* Timestamp must be visible before the pulse is counted. */
+    index.rdata_cnt[i] = cnt;
+    index.rdata_op[i] = op;
+    barrier();
+    index.nr_pulses++;
+}
+
 static void IRQ_INDEX_changed(void)
 {
     unsigned int cnt = tim_rdata->cnt;
@@ -1853,6 +3870,12 @@ static void IRQ_INDEX_changed(void)
     /* Clear INDEX-changed flag. */
     exti->pr = m(pin_index);
 
+    /* This edge started the RDATA timer: The pulse is at count zero. */
+    if (index.rdata_trig) {
+        index.rdata_trig = FALSE;
+        cnt = 0;
+    }
+
     delta = time_diff(index.trigger_time, now);
     if (delta < time_us(delay_params.index_mask))
         return;
@@ -1863,6 +3886,7 @@ static void IRQ_INDEX_changed(void)
             /* Long pulse indicates a subsequent sector hole. Filter it out
              * and unprime the index trigger. */
             index.hard_sector_trigger = 0;
+            index_report_pulse(cnt, FLUXOP_SECTOR);
             return;
         }
         /* First short pulse indicates the extra (index) hole. Second
@@ -1871,12 +3895,15 @@ static void IRQ_INDEX_changed(void)
         index.hard_sector_trigger ^= 1;
         if (index.hard_sector_trigger) {
             /* Filter out the "rising edge" of the trigger. */
+            index_report_pulse(cnt, FLUXOP_INDEX);
             return;
         }
+        index_report_pulse(cnt, FLUXOP_SECTOR);
+    } else {
+        index_report_pulse(cnt, FLUXOP_INDEX);
     }
 
     index.count++;
-    index.rdata_cnt = cnt;
 }
 
 static void index_timer(void *unused)
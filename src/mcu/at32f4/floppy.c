@@ -51,7 +51,24 @@ typedef uint16_t timcnt_t;
 #define irq_index 40
 void IRQ_40(void) __attribute__((alias("IRQ_INDEX_changed"))); /* EXTI15_10 */
 
+#define irq_rdata_dma 15
+void IRQ_15(void) __attribute__((alias("IRQ_rdata_dma"))); /* DMA1 Ch5 */
+#define dma_rdata_clear_irq() (dma1->ifcr = DMA_IFCR_CGIF(5))
+
+#define irq_wdata_dma 12
+void IRQ_12(void) __attribute__((alias("IRQ_wdata_dma"))); /* DMA1 Ch2 */
+#define dma_wdata_clear_irq() (dma1->ifcr = DMA_IFCR_CGIF(2))
+
 static unsigned int U_BUF_SZ;
+#define VERIFY_BLOCKS 256
+/* The 16-bit sample counter limits us to the default clock or slower. */
+#define sample_mhz_ok(mhz) (((mhz) >= MIN_SAMPLE_MHZ) && ((mhz) <= 72) \
+                            && !(SYSCLK_MHZ % (mhz)))
+/* INDEX (PB10) reaches the RDATA Timer only under a remap that displaces
+ * WDATA: Index-cued reads align in software. */
+#define index_trigger_available FALSE
+#define index_trigger_arm() ((void)0)
+#define index_trigger_disarm() ((void)0)
 
 static void fpec_extend_sram(bool_t extend)
 {
@@ -140,12 +157,15 @@ static void rdata_prep(void)
 
     /* RDATA DMA setup: From the RDATA Timer's CCRx into a circular buffer. */
     dma_rdata.par = (uint32_t)(unsigned long)&tim_rdata->ccr1;
+    dma_rdata_clear_irq();
     dma_rdata.cr = (DMA_CR_PL_HIGH |
                     DMA_CR_MSIZE_16BIT |
                     DMA_CR_PSIZE_16BIT |
                     DMA_CR_MINC |
                     DMA_CR_CIRC |
                     DMA_CR_DIR_P2M |
+                    DMA_CR_HTIE |
+                    DMA_CR_TCIE |
                     DMA_CR_EN);
 
     tim_rdata->ccer = TIM_CCER_CC1E | TIM_CCER_CC1P;
@@ -177,6 +197,8 @@ static void dma_wdata_start(void)
                     DMA_CR_MINC |
                     DMA_CR_CIRC |
                     DMA_CR_DIR_M2P |
+                    DMA_CR_HTIE |
+                    DMA_CR_TCIE |
                     DMA_CR_EN);
 }
 
@@ -55,7 +55,19 @@ typedef uint16_t timcnt_t;
 #define irq_index 23
 void IRQ_23(void) __attribute__((alias("IRQ_INDEX_changed"))); /* EXTI9_5 */
 
+#define irq_rdata_dma 17
+void IRQ_17(void) __attribute__((alias("IRQ_rdata_dma"))); /* DMA1 Ch7 */
+#define dma_rdata_clear_irq() (dma1->ifcr = DMA_IFCR_CGIF(7))
+
+#define irq_wdata_dma 13
+void IRQ_13(void) __attribute__((alias("IRQ_wdata_dma"))); /* DMA1 Ch3 */
+#define dma_wdata_clear_irq() (dma1->ifcr = DMA_IFCR_CGIF(3))
+
 static unsigned int U_BUF_SZ;
+#define VERIFY_BLOCKS 256
+/* The 16-bit sample counter limits us to the default clock or slower. */
+#define sample_mhz_ok(mhz) (((mhz) >= MIN_SAMPLE_MHZ) && ((mhz) <= 72) \
+                            && !(SYSCLK_MHZ % (mhz)))
 
 static void floppy_mcu_init(void)
 {
@@ -122,17 +134,42 @@ static void rdata_prep(void)
 
     /* RDATA DMA setup: From the RDATA Timer's CCRx into a circular buffer. */
     dma_rdata.par = (uint32_t)(unsigned long)&tim_rdata->ccr2;
+    dma_rdata_clear_irq();
     dma_rdata.cr = (DMA_CR_PL_HIGH |
                     DMA_CR_MSIZE_16BIT |
                     DMA_CR_PSIZE_16BIT |
                     DMA_CR_MINC |
                     DMA_CR_CIRC |
                     DMA_CR_DIR_P2M |
+                    DMA_CR_HTIE |
+                    DMA_CR_TCIE |
                     DMA_CR_EN);
 
     tim_rdata->ccer = TIM_CCER_CC2E | TIM_CCER_CC2P;
 }
 
+/* Index-cued reads: INDEX (PB6) is also Timer 4 Ch.1. Timer 4 is enabled by
+ * the falling edge of INDEX (trigger mode on TI1FP1), and its TRGO (CNT_EN)
+ * starts the RDATA Timer (trigger mode on ITR3). The RDATA Timer therefore
+ * counts from zero at the index pulse. */
+#define index_trigger_available TRUE
+static void index_trigger_arm(void)
+{
+    tim4->cr1 = 0;
+    tim4->ccmr1 = TIM_CCMR1_CC1S(TIM_CCS_INPUT_TI1);
+    tim4->ccer = TIM_CCER_CC1P;
+    tim4->cr2 = TIM_CR2_MMS(1);
+    tim_rdata->smcr = TIM_SMCR_TS(3) | TIM_SMCR_SMS(6);
+    tim4->smcr = TIM_SMCR_TS(5) | TIM_SMCR_SMS(6);
+}
+
+static void index_trigger_disarm(void)
+{
+    tim4->smcr = 0;
+    tim4->cr1 = 0;
+    tim_rdata->smcr = 0;
+}
+
 static void wdata_prep(void)
 {
     /* WDATA Timer setup:
@@ -159,6 +196,8 @@ static void dma_wdata_start(void)
                     DMA_CR_MINC |
                     DMA_CR_CIRC |
                     DMA_CR_DIR_M2P |
+                    DMA_CR_HTIE |
+                    DMA_CR_TCIE |
                     DMA_CR_EN);
 }
 
@@ -55,7 +55,25 @@ typedef uint32_t timcnt_t;
 #define irq_index 8
 void IRQ_8(void) __attribute__((alias("IRQ_INDEX_changed"))); /* EXTI2 */
 
+#define irq_rdata_dma 16
+void IRQ_16(void) __attribute__((alias("IRQ_rdata_dma"))); /* DMA1 Str5 */
+#define dma_rdata_clear_irq() \
+    (dma1->hifcr = (DMA_IFCR_CTCIF | DMA_IFCR_CHTIF) << 6)
+
+#define irq_wdata_dma 12
+void IRQ_12(void) __attribute__((alias("IRQ_wdata_dma"))); /* DMA1 Str1 */
+#define dma_wdata_clear_irq() \
+    (dma1->lifcr = (DMA_IFCR_CTCIF | DMA_IFCR_CHTIF) << 6)
+
 #define U_BUF_SZ (128*1024)
+#define VERIFY_BLOCKS 2048
+/* TIM2 is clocked at SYSCLK (TIMPRE=1) and its counter is 32 bits. */
+#define sample_mhz_ok(mhz) (((mhz) >= MIN_SAMPLE_MHZ) \
+                            && !(SYSCLK_MHZ % (mhz)))
+/* INDEX (PB2) has no timer function: Index-cued reads align in software. */
+#define index_trigger_available FALSE
+#define index_trigger_arm() ((void)0)
+#define index_trigger_disarm() ((void)0)
 
 static void floppy_mcu_init(void)
 {
@@ -103,13 +121,16 @@ static void rdata_prep(void)
 
     /* RDATA DMA setup: From the RDATA Timer's CCRx into a circular buffer. */
     dma_rdata.par = (uint32_t)(unsigned long)&tim_rdata->ccr1;
+    dma_rdata_clear_irq();
     dma_rdata.cr = (DMA_CR_CHSEL(3) |
                     DMA_CR_PL_HIGH |
                     DMA_CR_MSIZE_32BIT |
                     DMA_CR_PSIZE_32BIT |
                     DMA_CR_MINC |
                     DMA_CR_CIRC |
-                    DMA_CR_DIR_P2M);
+                    DMA_CR_DIR_P2M |
+                    DMA_CR_HTIE |
+                    DMA_CR_TCIE);
     dma_rdata.cr |= DMA_CR_EN;
 
     tim_rdata->ccer = TIM_CCER_CC1E | TIM_CCER_CC1P;
@@ -141,7 +162,9 @@ static void dma_wdata_start(void)
                     DMA_CR_PSIZE_32BIT |
                     DMA_CR_MINC |
                     DMA_CR_CIRC |
-                    DMA_CR_DIR_M2P);
+                    DMA_CR_DIR_M2P |
+                    DMA_CR_HTIE |
+                    DMA_CR_TCIE);
     dma_wdata.cr |= DMA_CR_EN;
 }
 
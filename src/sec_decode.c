@@ -0,0 +1,214 @@
+/*
+ * sec_decode.c
+ *
+ * IBM FM/MFM sector decode, via a simple software PLL. Included by floppy.c,
+ * which provides the decoder state (rd.secdec) and the u_buf[] output ring.
+ * Also built on the host by tests/sec_decode.c.
+ *
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+static struct sector *sec_find(const uint8_t *id)
+{
+    struct sector *sec;
+    unsigned int i;
+
+    for (i = 0; i < rd.secdec.nr_sectors; i++) {
+        sec = &rd.secdec.sectors[i];
+        if (!memcmp(sec->id, id, 4))
+            return sec;
+    }
+
+    if (rd.secdec.nr_sectors == MAX_SECTORS)
+        return NULL;
+
+    sec = &rd.secdec.sectors[rd.secdec.nr_sectors++];
+    memcpy(sec->id, id, 4);
+    sec->state = SEC_id;
+    return sec;
+}
+
+static void sec_mark(uint8_t mark)
+{
+    rd.secdec.crc = crc16_ccitt(&mark, 1, rd.secdec.crc);
+    rd.secdec.bytecnt = 0;
+    rd.secdec.state = SD_search;
+
+    switch (mark) {
+
+    case 0xfe: /* IDAM */
+        rd.secdec.state = SD_id;
+        break;
+
+    case 0xf8 ... 0xfb: /* DAM */
+        /* Only interested in data following a good ID field, for a sector
+         * we have not yet successfully read. */
+        if (!rd.secdec.id_ttl || !rd.secdec.sec
+            || (rd.secdec.sec->state == SEC_good))
+            break;
+        rd.secdec.data_len = 128u << (rd.secdec.id[3] & 7);
+        /* Skip this sector if it does not fit in the output buffer. */
+        if ((U_BUF_SZ - (uint32_t)(u_prod - u_cons))
+            < (sizeof(struct gw_sector) + rd.secdec.data_len))
+            break;
+        rd.secdec.data_prod = u_prod + sizeof(struct gw_sector);
+        rd.secdec.deleted = (mark <= 0xf9);
+        rd.secdec.state = SD_data;
+        break;
+
+    }
+}
+
+static void sec_byte(uint8_t b)
+{
+    switch (rd.secdec.state) {
+
+    case SD_mark:
+        /* MFM: Skip any further A1 sync bytes. */
+        if (b == 0xa1) {
+            if (++rd.secdec.bytecnt > 3)
+                rd.secdec.state = SD_search;
+            break;
+        }
+        rd.secdec.crc = 0xcdb4; /* CRC of A1,A1,A1 */
+        sec_mark(b);
+        break;
+
+    case SD_id:
+        rd.secdec.crc = crc16_ccitt(&b, 1, rd.secdec.crc);
+        if (rd.secdec.bytecnt < 4)
+            rd.secdec.id[rd.secdec.bytecnt] = b;
+        if (++rd.secdec.bytecnt < 6)
+            break;
+        if (rd.secdec.crc == 0) {
+            rd.secdec.sec = sec_find(rd.secdec.id);
+            rd.secdec.id_ttl = 64*16; /* 64 bytes */
+        } else {
+            rd.secdec.id_ttl = 0;
+        }
+        rd.secdec.state = SD_search;
+        break;
+
+    case SD_data:
+        rd.secdec.crc = crc16_ccitt(&b, 1, rd.secdec.crc);
+        if (rd.secdec.bytecnt < rd.secdec.data_len)
+            u_buf[U_MASK(rd.secdec.data_prod++)] = b;
+        if (++rd.secdec.bytecnt < rd.secdec.data_len + 2)
+            break;
+        if (rd.secdec.crc == 0) {
+            /* Good data: Commit the sector to the output stream. */
+            struct gw_sector hdr = {
+                .flags = m(_GW_SF_valid) | m(_GW_SF_data)
+                | (rd.secdec.deleted ? m(_GW_SF_deleted) : 0)
+            };
+            memcpy(&hdr.c, rd.secdec.id, 4);
+            _write_bytes(u_prod, &hdr, sizeof(hdr));
+            u_prod = rd.secdec.data_prod;
+            rd.secdec.sec->state = SEC_good;
+        } else {
+            rd.secdec.sec->state = SEC_bad_data;
+        }
+        rd.secdec.id_ttl = 0;
+        rd.secdec.state = SD_search;
+        break;
+
+    default:
+        break;
+
+    }
+}
+
+static bool_t sec_sync(void)
+{
+    uint32_t sr = rd.secdec.sr;
+
+    if (rd.secdec.encoding == SECENC_IBM_MFM) {
+        /* Two consecutive A1 sync bytes (missing clock bit). */
+        if (sr != 0x44894489)
+            return FALSE;
+        rd.secdec.bytecnt = 2;
+        rd.secdec.state = SD_mark;
+    } else {
+        /* FM: Address mark with missing clock bits, preceded by zeroes. */
+        uint8_t mark;
+        if ((sr >> 16) != 0xaaaa)
+            return FALSE;
+        switch (sr & 0xffff) {
+        case 0xf57e: mark = 0xfe; break;
+        case 0xf56f: mark = 0xfb; break;
+        case 0xf56a: mark = 0xf8; break;
+        default: return FALSE;
+        }
+        rd.secdec.crc = 0xffff;
+        sec_mark(mark);
+    }
+
+    rd.secdec.bitcnt = 0;
+    return TRUE;
+}
+
+static void sec_cell(unsigned int bit)
+{
+    rd.secdec.sr = (rd.secdec.sr << 1) | bit;
+    if ((rd.secdec.state != SD_search) && !(++rd.secdec.bitcnt & 1)) {
+        /* Data bit. */
+        rd.secdec.byte = (rd.secdec.byte << 1) | bit;
+        if (!(rd.secdec.bitcnt & 15))
+            sec_byte(rd.secdec.byte);
+    }
+
+    /* Sync marks may always restart the state machine (in case of a spurious
+     * earlier mark). FM marks may end in a zero cell, so every cell is
+     * checked. A match resets bitcnt: The mark ends on a byte boundary. */
+    if (rd.secdec.state != SD_data)
+        sec_sync();
+}
+
+static void sec_bits(unsigned int zeros)
+{
+    /* Bitcells elapsed: @zeros followed by a one. */
+    if (rd.secdec.id_ttl)
+        rd.secdec.id_ttl = (rd.secdec.id_ttl > zeros)
+            ? rd.secdec.id_ttl - zeros - 1 : 0;
+
+    while (zeros-- != 0)
+        sec_cell(0);
+    sec_cell(1);
+}
+
+/* Simple software PLL, bitcell period in fixed point (ticks << 8). */
+static void sec_flux(uint32_t t)
+{
+    int32_t n, clock = rd.secdec.clock, centre = rd.secdec.clock_centre;
+
+    rd.secdec.ticks += min_t(uint32_t, t, 0xffff) << 8;
+    if (rd.secdec.ticks < clock/2)
+        return;
+
+    n = (rd.secdec.ticks + clock/2) / clock;
+    rd.secdec.ticks -= n * clock;
+
+    /* Adjust clock towards observed phase, or back to centre on long gaps. */
+    clock += (n <= 4) ? rd.secdec.ticks / 20 : (centre - clock) / 20;
+    clock = max_t(int32_t, centre - centre/10,
+                  min_t(int32_t, centre + centre/10, clock));
+    rd.secdec.clock = clock;
+
+    /* Retain only part of the phase error. */
+    rd.secdec.ticks = rd.secdec.ticks * 2 / 5;
+
+    sec_bits(n - 1);
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
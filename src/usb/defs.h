@@ -100,6 +100,10 @@ struct usb_driver {
     void (*read)(uint8_t epnr, void *buf, uint32_t len);
     void (*write)(uint8_t epnr, const void *buf, uint32_t len);
     void (*stall)(uint8_t epnr);
+
+    /* Optional: Multi-packet IN transfers (see usb_write_xfer()). */
+    uint32_t (*max_xfer)(void);
+    void (*write_xfer)(uint8_t epnr, const void *buf, uint32_t len);
 };
 
 extern const struct usb_driver dwc_otg;
@@ -80,6 +80,19 @@ void usb_write(uint8_t epnr, const void *buf, uint32_t len)
 {
     drv->write(epnr, buf, len);
 }
+
+uint32_t usb_max_xfer(void)
+{
+    return drv->max_xfer ? drv->max_xfer() : usb_bulk_mps;
+}
+
+void usb_write_xfer(uint8_t epnr, const void *buf, uint32_t len)
+{
+    if (drv->write_xfer)
+        drv->write_xfer(epnr, buf, len);
+    else
+        drv->write(epnr, buf, len);
+}
  
 void usb_stall(uint8_t epnr)
 {
@@ -14,10 +14,18 @@
 int conf_iface;
 static bool_t is_hs;
 
+/* In DMA mode, rx_buf data is written by the core behind the D-cache. Each
+ * buffer is cache-line aligned so that invalidating its data cannot discard
+ * CPU writes to neighbouring fields. */
 static struct rx_buf {
     uint32_t data[MAX_MPS / 4];
     uint32_t count;
-} rx_buf0[1], rx_bufn[32] section_ext_ram;
+} aligned(conf_dma ? DCACHE_LINE : 4)
+    rx_buf0[1], rx_bufn[32] section_ext_ram;
+
+/* In DMA mode, IN payloads are staged here: DTCM (not cached, and so needs
+ * no maintenance), and owned by us until the transfer completes. */
+static uint32_t dma_tx_buf[conf_dma ? conf_nr_ep : 0][MAX_MPS / 4];
 
 #define RX_MASK(_ep, _idx) (((_ep)->_idx) & ((_ep)->rx_nr - 1))
 
@@ -69,6 +77,11 @@ static bool_t is_high_speed(void)
     return ((otgd->dsts >> 1) & 3) == 0;
 }
 
+static uint16_t ep_mps(uint8_t epnr)
+{
+    return (epnr == 0) ? EP0_MPS : (otg_doep[epnr].ctl & 0x7ff);
+}
+
 static void prepare_rx(uint8_t epnr)
 {
     struct ep *ep = &eps[epnr];
@@ -83,7 +96,16 @@ static void prepare_rx(uint8_t epnr)
     if (nr <= ep->rx_nr/2)
         return;
 
-    mps = (epnr == 0) ? EP0_MPS : (doep->ctl & 0x7ff);
+    mps = ep_mps(epnr);
+    if (conf_dma) {
+        /* DMA: One packet per transfer, straight into the next rx_buf.
+         * Discard any cached lines of the buffer first (eg. dirtied by the
+         * SETUP memmove), so that none is later evicted over the DMA data. */
+        struct rx_buf *rx = &ep->rx[RX_MASK(ep, rxp)];
+        nr = 1;
+        dcache_invalidate_range(rx->data, sizeof(rx->data));
+        doep->dma = (uint32_t)rx->data;
+    }
     tsiz = doep->tsiz & 0xe0000000;
     tsiz |= OTG_DOEPTSZ_PKTCNT(nr);
     tsiz |= OTG_DOEPTSZ_XFERSIZ(mps * nr);
@@ -102,6 +124,32 @@ static void read_packet(void *p, int len)
         *_p++ = otg_dfifo[0].x[0];
 }
 
+/* DMA mode: Account for an OUT transfer (a single packet) just completed. */
+static void dma_rx_done(uint8_t epnr, bool_t is_setup)
+{
+    struct ep *ep = &eps[epnr];
+    OTG_DOEP doep = &otg_doep[epnr];
+    struct rx_buf *rx;
+    uint32_t count;
+
+    ASSERT((uint16_t)(ep->rxp - ep->rxc) < ep->rx_nr);
+    rx = &ep->rx[RX_MASK(ep, rxp++)];
+
+    if (is_setup) {
+        /* Up to three back-to-back SETUP packets. The last one counts. */
+        count = doep->dma - (uint32_t)rx->data;
+        dcache_invalidate_range(rx->data, count);
+        if (count > 8)
+            memmove(rx->data, (uint8_t *)rx->data + count - 8, 8);
+        count = 8;
+    } else {
+        count = ep_mps(epnr) - (doep->tsiz & OTG_DOEPTSZ_XFERSIZ(0x7ffff));
+        dcache_invalidate_range(rx->data, count);
+    }
+
+    rx->count = count;
+}
+
 static void write_packet(const void *p, uint8_t epnr, int len)
 {
     const uint32_t *_p = p;
@@ -189,8 +237,14 @@ static void dwc_otg_init(void)
     otg->gintmsk = (OTG_GINT_USBRST |
                     OTG_GINT_ENUMDNE |
                     OTG_GINT_IEPINT |
-                    OTG_GINT_OEPINT |
-                    OTG_GINT_RXFLVL);
+                    OTG_GINT_OEPINT);
+    if (conf_dma) {
+        /* The core's DMA engine empties the RX FIFO for us. */
+        otg->gahbcfg = (OTG_GAHBCFG_HBSTLEN(HBSTLEN_INCR4) |
+                        OTG_GAHBCFG_DMAEN);
+    } else {
+        otg->gintmsk |= OTG_GINT_RXFLVL;
+    }
 
     fifos_init();
 
@@ -228,13 +282,50 @@ static void dwc_otg_write(uint8_t epnr, const void *buf, uint32_t len)
 {
     OTG_DIEP diep = &otg_diep[epnr];
 
+    if (conf_dma) {
+        /* The core fetches the payload at its leisure, so we need our own
+         * copy. This is still much cheaper than word-by-word FIFO writes.
+         * Payloads which stay put until the transfer completes are sent
+         * without a copy by dwc_otg_write_xfer(). */
+        memcpy(dma_tx_buf[epnr], buf, len);
+        diep->dma = (uint32_t)dma_tx_buf[epnr];
+    }
+
     diep->tsiz = OTG_DIEPTSIZ_PKTCNT(1) | len;
 
 //    if (len != 0)
 //        otgd->diepempmsk |= 1u << epnr;
 
     diep->ctl |= OTG_DIEPCTL_CNAK | OTG_DIEPCTL_EPENA;
-    write_packet(buf, epnr, len);
+    if (!conf_dma)
+        write_packet(buf, epnr, len);
+    eps[epnr].tx_ready = FALSE;
+}
+
+static uint32_t dwc_otg_max_xfer(void)
+{
+    /* Without DMA, each packet must be pushed into the FIFO by the CPU. */
+    return conf_dma ? 16*1024 : usb_bulk_mps;
+}
+
+static void dwc_otg_write_xfer(uint8_t epnr, const void *buf, uint32_t len)
+{
+    OTG_DIEP diep = &otg_diep[epnr];
+    uint32_t mps = diep->ctl & 0x7ff, nr;
+
+    if (!conf_dma) {
+        dwc_otg_write(epnr, buf, len);
+        return;
+    }
+
+    /* The core fetches the payload directly from @buf, even for a single
+     * packet: Only usb_write() needs the dma_tx_buf[] bounce. */
+    ASSERT(!((uint32_t)buf & 3));
+    dcache_clear_range(buf, len);
+    diep->dma = (uint32_t)buf;
+    nr = max_t(uint32_t, (len + mps - 1) / mps, 1);
+    diep->tsiz = OTG_DIEPTSIZ_PKTCNT(nr) | len;
+    diep->ctl |= OTG_DIEPCTL_CNAK | OTG_DIEPCTL_EPENA;
     eps[epnr].tx_ready = FALSE;
 }
 
@@ -377,9 +468,18 @@ static void handle_oepint(uint8_t epnr)
 
     otg_doep[epnr].intsts = oepint;
 
+    if (conf_dma && (otg_doep[epnr].intsts & OTG_DOEPINT_STPKTRX)) {
+        /* DMA: XFRC also flags receipt of a SETUP packet. We handle that at
+         * the subsequent STUP. */
+        otg_doep[epnr].intsts = OTG_DOEPINT_STPKTRX;
+        oepint &= ~OTG_DOEPMSK_XFRCM;
+    }
+
     if (oepint & OTG_DOEPMSK_XFRCM) {
         ASSERT(ep->rx_active);
         ep->rx_active = FALSE;
+        if (conf_dma)
+            dma_rx_done(epnr, FALSE);
         if (epnr == 0)
             handle_rx_ep0(FALSE);
     }
@@ -387,6 +487,8 @@ static void handle_oepint(uint8_t epnr)
     if (oepint & OTG_DOEPMSK_STUPM) {
         ASSERT(ep->rx_active);
         ep->rx_active = FALSE;
+        if (conf_dma)
+            dma_rx_done(epnr, TRUE);
         if (epnr == 0)
             handle_rx_ep0(TRUE);
     }
@@ -476,7 +578,10 @@ const struct usb_driver dwc_otg = {
     .ep_tx_ready = dwc_otg_ep_tx_ready,
     .read = dwc_otg_read,
     .write = dwc_otg_write,
-    .stall = dwc_otg_stall
+    .stall = dwc_otg_stall,
+
+    .max_xfer = dwc_otg_max_xfer,
+    .write_xfer = dwc_otg_write_xfer
 };
 
 /*
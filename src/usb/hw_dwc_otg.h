@@ -24,6 +24,9 @@
 #define MAX_MPS USB_FS_MPS
 #endif
 #define conf_nr_ep 4
+/* Only the HS core has the internal AHB DMA engine. Packets then move
+ * directly between the core and RAM, rather than via CPU FIFO accesses. */
+#define conf_dma (conf_port == PORT_HS)
 
 /* USB On-The-Go Full Speed interface */
 struct otg {
@@ -143,6 +146,9 @@ struct otg_dfifo { /* 1000.. */
 
 #define OTG_GAHBCFG_PTXFELVL (1u<< 8)
 #define OTG_GAHBCFG_TXFELVL  (1u<< 7)
+#define OTG_GAHBCFG_DMAEN    (1u<< 5)
+#define OTG_GAHBCFG_HBSTLEN(x) ((x)<<1)
+#define HBSTLEN_INCR4        3u
 #define OTG_GAHBCFG_GINTMSK  (1u<< 0)
 
 #define OTG_GUSBCFG_CTXPKT   (1u<<31)
@@ -306,6 +312,8 @@ struct otg_dfifo { /* 1000.. */
 #define OTG_DIEPINT_TXFE      (1u<< 7)
 #define OTG_DIEPINT_XFRC      (1u<< 0)
 
+#define OTG_DOEPINT_STPKTRX   (1u<<15)
+
 #define OTG_DOEPMSK_NYETMSK   (1u<<14)
 #define OTG_DOEPMSK_NAKM      (1u<<13)
 #define OTG_DOEPMSK_BERRM     (1u<<12)
@@ -53,6 +53,16 @@ void usb_write(uint8_t epnr, const void *buf, uint32_t len)
 {
     usbd.write(epnr, buf, len);
 }
+
+uint32_t usb_max_xfer(void)
+{
+    return usb_bulk_mps;
+}
+
+void usb_write_xfer(uint8_t epnr, const void *buf, uint32_t len)
+{
+    usbd.write(epnr, buf, len);
+}
  
 void usb_stall(uint8_t epnr)
 {
@@ -142,6 +142,16 @@ void usb_write(uint8_t epnr, const void *buf, uint32_t len)
 {
     dwc_otg.write(epnr, buf, len);
 }
+
+uint32_t usb_max_xfer(void)
+{
+    return dwc_otg.max_xfer();
+}
+
+void usb_write_xfer(uint8_t epnr, const void *buf, uint32_t len)
+{
+    dwc_otg.write_xfer(epnr, buf, len);
+}
  
 void usb_stall(uint8_t epnr)
 {
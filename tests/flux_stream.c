@@ -0,0 +1,316 @@
+/*
+ * flux_stream.c
+ *
+ * Host-side round-trip test of the flux stream interval codec
+ * (inc/flux_stream.h), in standard and nibble encodings. Built and run by
+ * "make test".
+ *
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define packed __attribute__((packed))
+#define always_inline __inline__ __attribute__((always_inline))
+
+#include "cdc_acm_protocol.h"
+#include "flux_stream.h"
+
+static unsigned int nr_fail;
+
+#define fail(fmt, ...) do {                                     \
+    printf("FAIL lead=%u ticks=%u: " fmt "\n", lead, ticks,     \
+           ## __VA_ARGS__);                                     \
+    nr_fail++;                                                  \
+    return;                                                     \
+} while (0)
+
+/* Decode one interval (and any preceding FLUXOP_SPACE) as the write path
+ * does, returning the number of bytes consumed. */
+static unsigned int decode(const uint8_t *p, unsigned int lead,
+                           uint32_t *ticks)
+{
+    const uint8_t *q = p;
+
+    *ticks = 0;
+    for (;;) {
+        if (*q < lead) {
+            *ticks += *q++;
+            break;
+        }
+        if (*q < 255) {
+            *ticks += flux_decode2(q[0], q[1], lead);
+            q += 2;
+            break;
+        }
+        if (q[1] != FLUXOP_SPACE)
+            return 0;
+        *ticks += flux_decode_n28(&q[2]);
+        q += 6;
+    }
+
+    return q - p;
+}
+
+static void check(unsigned int lead, uint32_t ticks, unsigned int want_len)
+{
+    uint8_t b[FLUX_MAX_ENC + 1];
+    unsigned int i, len;
+    uint32_t x;
+
+    len = flux_encode(b, ticks, lead) - b;
+    if (want_len && (len != want_len))
+        fail("encoded to %u bytes, expected %u", len, want_len);
+    if ((len != 1) && (len != 2) && (len != FLUX_MAX_ENC))
+        fail("encoded to %u bytes", len);
+    for (i = 0; i < len; i++)
+        if (b[i] == 0)
+            fail("byte %u is EOStream", i);
+    if (decode(b, lead, &x) != len)
+        fail("decode length mismatch");
+    if (x != ticks)
+        fail("decoded to %u", x);
+}
+
+static void check_lead(unsigned int lead)
+{
+    uint32_t max2 = lead + 255*(255-lead) - 1;
+    uint32_t max7 = ((1u << 28) - 1) + (lead - 1);
+    uint32_t ticks;
+
+    /* Range boundaries. */
+    check(lead, 1, 1);
+    check(lead, lead-1, 1);
+    check(lead, lead, 2);
+    check(lead, max2, 2);
+    check(lead, max2+1, 7);
+    check(lead, max7, 7);
+
+    /* Every interval up to well beyond the two-byte range. */
+    for (ticks = 1; ticks < 4*max2; ticks++)
+        check(lead, ticks, 0);
+
+    /* N28 bit patterns. */
+    for (ticks = 1; ticks < (1u << 28); ticks <<= 1) {
+        check(lead, max2 + ticks, 7);
+        check(lead, max7 - ticks, 7);
+    }
+}
+
+/* Nibble encoding: Stream events, with SPACE merged into the following
+ * flux interval as the write path does. */
+enum { EV_flux, EV_index, EV_astable };
+struct event {
+    uint8_t type;
+    uint32_t ticks;
+};
+
+#define NR_EVENTS 100000
+static struct event want[NR_EVENTS], got[NR_EVENTS];
+static uint8_t stream[NR_EVENTS * (NIBBLE_MAX_ENC + 6) + 1];
+static unsigned int nr_escape, nr_escape_space, nr_classed;
+
+static void nibble_fail(const char *test, unsigned int i, const char *msg)
+{
+    printf("FAIL nibble %s: event %u: %s\n", test, i, msg);
+    nr_fail++;
+}
+
+/* Decode a nibble stream as the host (FLUXOP_INDEX) and the write path
+ * (FLUXOP_SPACE, FLUXOP_ASTABLE) do. Returns the number of events, or -1
+ * if the stream is invalid. */
+static int nibble_decode_stream(const uint8_t *p, unsigned int lead,
+                                uint32_t quantum)
+{
+    uint32_t ticks = 0;
+    unsigned int n = 0, hi;
+    int lo, escape = 0;
+
+    for (;;) {
+        if (*p == 0)
+            return n;
+        if (*p == 0xff) {
+            switch (p[1]) {
+            case FLUXOP_INDEX:
+                got[n].type = EV_index;
+                got[n++].ticks = flux_decode_n28(&p[2]);
+                break;
+            case FLUXOP_SPACE:
+                ticks += flux_decode_n28(&p[2]);
+                nr_escape_space += escape;
+                break;
+            case FLUXOP_ASTABLE:
+                got[n].type = EV_astable;
+                got[n++].ticks = flux_decode_n28(&p[2]);
+                break;
+            default:
+                return -1;
+            }
+            p += 6;
+            continue;
+        }
+        if (escape) {
+            /* Exact interval in standard encoding. */
+            if (*p < lead) {
+                ticks += *p++;
+            } else {
+                ticks += flux_decode2(p[0], p[1], lead);
+                p += 2;
+            }
+            got[n].type = EV_flux;
+            got[n++].ticks = ticks;
+            ticks = 0;
+            escape = 0;
+            continue;
+        }
+        if ((lo = nibble_decode(*p++, &hi)) < 0)
+            return -1;
+        if (hi == 15) {
+            escape = 1;
+            nr_escape++;
+            hi = 0;
+        }
+        if (lo != 0) {
+            got[n].type = EV_flux;
+            got[n++].ticks = ticks + lo * quantum;
+            ticks = 0;
+            nr_classed++;
+        }
+        if (hi != 0) {
+            got[n].type = EV_flux;
+            got[n++].ticks = hi * quantum;
+            nr_classed++;
+        }
+    }
+}
+
+static uint32_t nibble_interval(uint32_t quantum, uint32_t tol)
+{
+    switch (rand() % 16) {
+    case 0: /* Anything, including short and off-class intervals. */
+        return 1 + rand() % (16 * quantum);
+    case 1: /* Beyond the largest class. */
+        return 15 * quantum + rand() % 1000;
+    case 2: /* Long enough to need FLUXOP_SPACE. */
+        return 20000 + rand() % 100000;
+    default: /* Near a class, sometimes beyond tolerance. */
+        return (2 + rand() % 3) * quantum
+            + rand() % (2 * tol + 9) - (tol + 4);
+    }
+}
+
+/* Round-trip random intervals interleaved with flux opcodes: FLUXOP_INDEX
+ * (@write == 0) as in read streams, or FLUXOP_SPACE and FLUXOP_ASTABLE
+ * (@write != 0) as in write streams. */
+static void check_nibble(const char *test, unsigned int lead,
+                         uint32_t quantum, uint32_t tol, int write)
+{
+    struct nibble_enc ne = { .quantum = quantum, .tolerance = tol };
+    uint32_t ticks, space = 0;
+    int64_t true_t = 0, host_t = 0, err;
+    unsigned int i, n, r;
+    uint8_t *q = stream;
+    int nr;
+
+    srand(lead + quantum + tol + write);
+    nr_escape = nr_escape_space = nr_classed = 0;
+
+    for (i = n = 0; i < NR_EVENTS; i++) {
+        r = rand() % 64;
+        if ((r == 0) && !write) {
+            ticks = rand() % (2 * quantum);
+            want[n].type = EV_index;
+            want[n++].ticks = ticks;
+            q = nibble_flush(&ne, q);
+            *q++ = 0xff;
+            *q++ = FLUXOP_INDEX;
+            q = flux_encode_n28(q, ticks);
+        } else if ((r == 1) && write) {
+            ticks = 1 + rand() % 5000;
+            space += ticks;
+            q = nibble_flush(&ne, q);
+            *q++ = 0xff;
+            *q++ = FLUXOP_SPACE;
+            q = flux_encode_n28(q, ticks);
+        } else if ((r == 2) && write && !space) {
+            ticks = (2 + rand() % 3) * quantum;
+            want[n].type = EV_astable;
+            want[n++].ticks = ticks;
+            q = nibble_flush(&ne, q);
+            *q++ = 0xff;
+            *q++ = FLUXOP_ASTABLE;
+            q = flux_encode_n28(q, ticks);
+        } else {
+            ticks = nibble_interval(quantum, tol);
+            want[n].type = EV_flux;
+            want[n++].ticks = space + ticks;
+            space = 0;
+            q = nibble_encode(&ne, q, ticks, lead);
+        }
+    }
+    q = nibble_flush(&ne, q);
+    *q++ = 0;
+
+    if ((nr = nibble_decode_stream(stream, lead, quantum)) < 0)
+        return nibble_fail(test, 0, "invalid stream");
+    if (nr != n)
+        return nibble_fail(test, nr, "event count mismatch");
+
+    for (i = 0; i < n; i++) {
+        if (got[i].type != want[i].type)
+            return nibble_fail(test, i, "event type mismatch");
+        if (want[i].type != EV_flux) {
+            if (got[i].ticks != want[i].ticks)
+                return nibble_fail(test, i, "opcode argument mismatch");
+            continue;
+        }
+        /* The host's sample cursor stays within tolerance. */
+        true_t += want[i].ticks;
+        host_t += got[i].ticks;
+        err = true_t - host_t;
+        if ((err < -(int64_t)tol) || (err > tol))
+            return nibble_fail(test, i, "sample cursor out of tolerance");
+    }
+
+    /* Both the classed and the escaped paths are exercised. */
+    if (!nr_classed || !nr_escape || !nr_escape_space)
+        nibble_fail(test, n, "encoding path not exercised");
+}
+
+int main(int argc, char **argv)
+{
+    /* Standard encoding: 249/250 and 1524/1525 boundaries. */
+    check_lead(250);
+    /* Wide encoding: 199/200 and 14224/14225 boundaries. */
+    check_lead(200);
+
+    /* Nibble encoding, read and write streams. */
+    check_nibble("read", 250, 72, 12, 0);
+    check_nibble("read-wide", 200, 72, 12, 0);
+    check_nibble("read-maxtol", 250, 48, 23, 0);
+    check_nibble("write", 250, 72, 12, 1);
+    check_nibble("write-zerotol", 250, 72, 0, 1);
+
+    if (nr_fail) {
+        printf("flux_stream: %u failures\n", nr_fail);
+        return EXIT_FAILURE;
+    }
+
+    printf("flux_stream: OK\n");
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,248 @@
+/*
+ * sec_decode.c
+ *
+ * Host-side test of the IBM FM/MFM sector decoder (src/sec_decode.c):
+ * Synthetic FM and MFM tracks are encoded to jittered flux and decoded.
+ * Built and run by "make test".
+ *
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define packed __attribute__((packed))
+
+typedef char bool_t;
+#define TRUE 1
+#define FALSE 0
+
+#define m(bitnr) (1u<<(bitnr))
+#define min_t(type,x,y) \
+    ({ type __x = (x); type __y = (y); __x < __y ? __x: __y; })
+#define max_t(type,x,y) \
+    ({ type __x = (x); type __y = (y); __x > __y ? __x: __y; })
+
+#include "cdc_acm_protocol.h"
+#include "sec_decode.h"
+
+/* Environment of the decoder, as provided by floppy.c. */
+#define U_BUF_SZ (64*1024)
+#define U_MASK(x) ((x)&(U_BUF_SZ-1))
+static uint8_t u_buf[U_BUF_SZ];
+static uint32_t u_prod, u_cons;
+static struct {
+    struct secdec secdec;
+} rd;
+
+static void _write_bytes(uint32_t prod, const void *p, unsigned int nr)
+{
+    const uint8_t *b = p;
+    while (nr--)
+        u_buf[U_MASK(prod++)] = *b++;
+}
+
+#include "../src/crc.c"
+#include "../src/sec_decode.c"
+
+#define CELL_TICKS 72
+#define NR_SECS 9
+#define SEC_N 1 /* 256-byte sectors */
+#define SEC_LEN (128u << SEC_N)
+#define MAX_CELLS (64*1024)
+
+static unsigned int nr_fail;
+
+/* Synthetic track, as a bitcell stream. */
+static uint8_t cells[MAX_CELLS];
+static unsigned int nr_cells;
+static bool_t mfm, prev_bit;
+static uint16_t crc;
+
+static void put_cell(unsigned int c)
+{
+    cells[nr_cells++] = c;
+}
+
+static void put_raw(uint16_t raw)
+{
+    int i;
+    for (i = 15; i >= 0; i--)
+        put_cell((raw >> i) & 1);
+    prev_bit = raw & 1;
+}
+
+/* A byte, with clock bits @clk (FM only). */
+static void put_byte_clk(uint8_t b, uint8_t clk)
+{
+    unsigned int bit;
+    int i;
+
+    crc = crc16_ccitt(&b, 1, crc);
+    for (i = 7; i >= 0; i--) {
+        bit = (b >> i) & 1;
+        put_cell(mfm ? !(prev_bit || bit) : (clk >> i) & 1);
+        put_cell(bit);
+        prev_bit = bit;
+    }
+}
+
+static void put_byte(uint8_t b)
+{
+    put_byte_clk(b, 0xff);
+}
+
+static void put_bytes(uint8_t b, unsigned int nr)
+{
+    while (nr--)
+        put_byte(b);
+}
+
+static void put_crc(void)
+{
+    uint16_t x = crc;
+    put_byte(x >> 8);
+    put_byte(x);
+}
+
+static uint8_t sec_data(unsigned int sec, unsigned int i)
+{
+    return sec * 37 + i * 11 + (i >> 8);
+}
+
+/* An address mark and its preceding sync. */
+static void put_mark(uint8_t mark)
+{
+    if (mfm) {
+        put_bytes(0x00, 12);
+        crc = 0xffff;
+        put_raw(0x4489); put_raw(0x4489); put_raw(0x4489);
+        crc = 0xcdb4;
+        put_byte(mark);
+    } else {
+        put_bytes(0x00, 6);
+        crc = 0xffff;
+        put_byte_clk(mark, 0xc7);
+    }
+}
+
+static void build_track(void)
+{
+    uint8_t gap = mfm ? 0x4e : 0xff;
+    unsigned int sec, i;
+
+    nr_cells = 0;
+    prev_bit = 0;
+    put_bytes(gap, mfm ? 80 : 40);
+    for (sec = 0; sec < NR_SECS; sec++) {
+        put_mark(0xfe);
+        put_byte(2); put_byte(1); put_byte(sec + 1); put_byte(SEC_N);
+        put_crc();
+        put_bytes(gap, mfm ? 22 : 11);
+        /* Odd sectors are marked deleted. */
+        put_mark((sec & 1) ? 0xf8 : 0xfb);
+        for (i = 0; i < SEC_LEN; i++)
+            put_byte(sec_data(sec, i));
+        put_crc();
+        put_bytes(gap, mfm ? 54 : 27);
+    }
+    put_bytes(gap, 16);
+}
+
+/* Feed the track to the decoder as flux, with up to +/-6% jitter. */
+static void decode_track(void)
+{
+    unsigned int i, n = 0;
+    int32_t t;
+
+    memset(&rd.secdec, 0, sizeof(rd.secdec));
+    rd.secdec.encoding = mfm ? SECENC_IBM_MFM : SECENC_IBM_FM;
+    rd.secdec.clock = rd.secdec.clock_centre = CELL_TICKS << 8;
+    u_prod = u_cons = 0;
+
+    srand(1);
+    for (i = 0; i < nr_cells; i++) {
+        n++;
+        if (!cells[i])
+            continue;
+        t = n * CELL_TICKS + (rand() % 9) - 4;
+        sec_flux(t);
+        n = 0;
+    }
+}
+
+static void check_track(bool_t _mfm)
+{
+    const char *name = _mfm ? "MFM" : "FM";
+    struct gw_sector hdr;
+    unsigned int sec, i;
+    uint32_t p = 0;
+    uint8_t flags;
+
+    mfm = _mfm;
+    build_track();
+    decode_track();
+
+    for (sec = 0; sec < NR_SECS; sec++) {
+        if ((u_prod - p) < sizeof(hdr)) {
+            printf("FAIL %s: %u of %u sectors decoded\n", name, sec, NR_SECS);
+            nr_fail++;
+            return;
+        }
+        memcpy(&hdr, &u_buf[p], sizeof(hdr));
+        p += sizeof(hdr);
+        flags = m(_GW_SF_valid) | m(_GW_SF_data)
+            | ((sec & 1) ? m(_GW_SF_deleted) : 0);
+        if ((hdr.flags != flags) || (hdr.c != 2) || (hdr.h != 1)
+            || (hdr.r != sec + 1) || (hdr.n != SEC_N)) {
+            printf("FAIL %s: sector %u header %02x %u/%u/%u/%u\n", name,
+                   sec, hdr.flags, hdr.c, hdr.h, hdr.r, hdr.n);
+            nr_fail++;
+            return;
+        }
+        for (i = 0; i < SEC_LEN; i++) {
+            if (u_buf[p + i] != sec_data(sec, i)) {
+                printf("FAIL %s: sector %u data mismatch at %u\n",
+                       name, sec, i);
+                nr_fail++;
+                return;
+            }
+        }
+        p += SEC_LEN;
+    }
+
+    if (u_prod != p) {
+        printf("FAIL %s: %u trailing bytes\n", name, u_prod - p);
+        nr_fail++;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    check_track(FALSE);
+    check_track(TRUE);
+
+    if (nr_fail) {
+        printf("sec_decode: %u failures\n", nr_fail);
+        return EXIT_FAILURE;
+    }
+
+    printf("sec_decode: OK\n");
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */